@@ -7,12 +7,64 @@
  * Copyright (c) 2013 Ramses van Zon
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for MAP_ANONYMOUS and MADV_HUGEPAGE */
+#endif
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
+#include "ndmalloc.h"
 #include "ndreg.ic"
 
+/* Note: unless NDMALLOC_NO_MMAP is defined, large arrays can be
+   allocated with anonymous memory mappings on unix-like systems, see
+   ndmallopt. */
+
+#if !defined(NDMALLOC_NO_MMAP) && (defined(__unix__) || defined(__APPLE__))
+#define ND_HAVE_MMAP
+#include <sys/mman.h>
+#include <unistd.h>
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#endif
+
+/* Threads are used to touch memory in parallel, to free memory in the
+   background and to lock the cache. */
+
+#if defined(ND_HAVE_MMAP) || defined(NDREG_PTHREAD_LOCK)
+#define ND_HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+/* NUMA memory policies are set with the mbind system call, and threads
+   are pinned to the cpus of a node with sched_setaffinity, without
+   needing libnuma. */
+
+#if defined(SYS_mbind) && defined(SYS_get_mempolicy) \
+    && defined(SYS_sched_setaffinity)
+#define ND_HAVE_NUMA
+#include <stdio.h>
+#define ND_MPOL_BIND            2
+#define ND_MPOL_INTERLEAVE      3
+#define ND_MPOL_F_MEMS_ALLOWED  4
+#define ND_MAX_NUMA_NODES       1024
+#define ND_MAX_CPUS             4096
+#endif
+
 /* Note: in ndreg.ic, NDREG_INT should set ndreg_int, and defaults to int. */
 
+/* Note: if NDMALLOC_NO_REGISTRY is defined, the registry in ndreg.ic is
+   disabled, and arrays are instead recognized by a keyed canary in
+   their header, whose key is seeded at run time. */
+
+#ifdef NDMALLOC_NO_REGISTRY
+#include <time.h>
+#endif
+
 /***************************************************************************/
 
 struct header {
@@ -27,14 +79,199 @@ struct header {
     short      rank;         /* number of dimensions           */
     short      magic;        /* magic_mark                     */
     size_t*    shape;        /* What are those dimensions?     */
+    size_t     size;         /* size of the elements in bytes  */
+    short      flags;        /* how the memory was allocated   */
+    short      depth;        /* levels of pointers, <= rank-1  */
+    void*      base;         /* start of the allocated memory  */
+    size_t     align;        /* requested alignment of data    */
+    size_t     pitch;        /* elements between rows of data */
+    size_t     maplength;    /* length of mapped memory or 0   */
+    size_t     capacity;     /* rows of dimension 0 reserved   */
+    size_t     origin;       /* first-level index of data      */
+    size_t     halo;         /* offset of inner-level pointers */
+    const ndallocator_t* allocator; /* of base, or NULL for malloc */
+#ifdef NDMALLOC_NO_REGISTRY
+    size_t     canary;       /* keyed check of the above       */
+#endif
+};
+
+struct nd_internal_chunk {
+
+ /* Start of a chunk of memory of an arena. Chunks are linked from the
+    first chunk to the last one, and kept until the arena is destroyed. */
+
+    struct nd_internal_chunk*  next;      /* next chunk                 */
+    char*                      end;       /* end of the chunk           */
+    size_t                     maplength; /* length of mapped memory    */
+    const ndallocator_t*       allocator; /* allocator of the chunk     */
+};
+
+struct ndarena {
+
+ /* Region from which nd arrays are bump-allocated.  When the current
+    chunk is full, the next chunk is used, or a new chunk is added. */
+
+    struct nd_internal_chunk*  first;     /* chunk to start from         */
+    struct nd_internal_chunk*  current;   /* chunk being allocated from  */
+    char*                      next;      /* first free byte in current  */
+};
+
+struct nd_internal_batch {
+
+ /* Start of the memory of a batch of arrays allocated together. The
+    memory is released when the last array of the batch is freed. */
+
+    size_t  live;                /* arrays in the batch not freed yet */
 };
 
+/* Decrement the number of live arrays in a batch, which may be freed
+   from different threads. */
+
+#if defined(__GNUC__)
+#define nd_internal_batch_release(b) \
+        __atomic_sub_fetch(&((struct nd_internal_batch*)(b))->live, 1, \
+                           __ATOMIC_ACQ_REL)
+#else
+#define nd_internal_batch_release(b) \
+        (--((struct nd_internal_batch*)(b))->live)
+#endif
+
 /* Define the magic mark to be embedded in the struct header.  These
    constant definitions presume at least 32 bits in an int, but will
    still work with less bits. */
 
 static short magic_mark      = 0x1972; /* in headers of allocated arrays */
 static short view_magic_mark = 0x1973; /* in headers of views on arrays  */
+static short parked_magic_mark = 0x1974; /* in headers of cached arrays   */
+
+/* Flags in the header that tell how the memory of an array was
+   allocated.  Arrays with no flags have their shape, pointer table
+   and data allocated separately. */
+
+#define single_block_flag 0x0001 /* shape, table and data in one block */
+#define aligned_flag      0x0002 /* data aligned to hdr->align bytes    */
+#define pitched_flag      0x0004 /* rows of data hdr->pitch apart       */
+#define arena_flag        0x0008 /* single block inside an ndarena      */
+#define batch_flag        0x0010 /* single block inside a batch         */
+#define partial_flag      0x0020 /* fewer than rank-1 pointer levels    */
+#define reserved_flag     0x0040 /* hdr->capacity rows of dimension 0   */
+#define slice_flag        0x0080 /* view on rows of another array       */
+#define permuted_flag     0x0100 /* first-level pointers reordered      */
+#define periodic_flag     0x0200 /* inner levels point hdr->halo in     */
+
+/* Rows of pitched arrays with an automatic pitch are padded to whole
+   cache lines. */
+
+#define cache_line_bytes 64
+
+/* Global options, set by ndmallopt. */
+
+static int    single_block_mode = 0; /* allocate arrays as single blocks */
+static size_t mmap_threshold    = 0; /* minimum bytes to map, 0 = never */
+#ifdef ND_HAVE_MMAP
+static int    mmap_flags        = 0; /* ND_MMAP_* flags for mappings    */
+#endif
+static size_t cache_capacity    = 0; /* bytes that may be cached, 0 = off */
+
+/* Allocators set by ndset_allocator for data and for metadata (pointer
+   tables and shapes); NULL stands for malloc, calloc, realloc and
+   free. Threads can override these with ndset_thread_allocator if the
+   compiler has thread-local storage. */
+
+static const ndallocator_t* data_allocator = NULL;
+static const ndallocator_t* meta_allocator = NULL;
+
+#if defined(__GNUC__)
+#define ND_THREAD_LOCAL __thread
+static ND_THREAD_LOCAL const ndallocator_t* thread_data_allocator = NULL;
+static ND_THREAD_LOCAL const ndallocator_t* thread_meta_allocator = NULL;
+#endif
+
+/* Freed arrays that may be handed out again by ndmalloc are parked in
+   a cache of at most cache_slots arrays, oldest first. Parked arrays
+   keep their pointer table and registry entries, but have the
+   parked_magic_mark in their headers. */
+
+#define cache_slots 64
+
+static void*  cache_parked[cache_slots];
+static size_t cache_nparked = 0; /* number of parked arrays          */
+static size_t cache_bytes   = 0; /* bytes held by the parked arrays  */
+static size_t cache_hits    = 0; /* allocations served by the cache  */
+static size_t cache_misses  = 0; /* allocations not found in it      */
+
+#if defined(NDREG_PTHREAD_LOCK)
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define nd_internal_cache_lock()   pthread_mutex_lock(&cache_mutex)
+#define nd_internal_cache_unlock() pthread_mutex_unlock(&cache_mutex)
+#else
+#define nd_internal_cache_lock()
+#define nd_internal_cache_unlock()
+#endif
+
+/* A block of memory to be released with nd_internal_free_memory. */
+
+struct nd_internal_block {
+    void*                 base;
+    size_t                maplength;
+    const ndallocator_t*  allocator;
+};
+
+/* Memory of arrays freed with ndfree_deferred, or with ndfree if the
+   ND_DEFERRED_FREE option is set, is queued in a ring buffer of
+   reclaim_slots blocks, from which a background thread releases it.
+   When the buffer is full the caller waits for the thread to make
+   room, so that a burst of frees never falls back to inline
+   unmapping. */
+
+#define reclaim_slots 1024
+
+static int deferred_free_mode = 0; /* ndfree defers the release */
+
+#ifdef ND_HAVE_PTHREADS
+static struct nd_internal_block reclaim_queue[reclaim_slots];
+static size_t          reclaim_head    = 0; /* oldest queued block        */
+static size_t          reclaim_count   = 0; /* number of queued blocks    */
+static int             reclaim_busy    = 0; /* a block is being released  */
+static int             reclaim_started = 0; /* the thread is running      */
+static pthread_t       reclaim_thread;
+static pthread_mutex_t reclaim_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  reclaim_work  = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  reclaim_idle  = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  reclaim_space = PTHREAD_COND_INITIALIZER;
+#endif
+
+/* Ways to initialize memory from nd_internal_alloc_memory. Untouched
+   memory is zero, and mapped if possible, but its pages have not been
+   touched yet, so that they can be placed by first touch. */
+
+#define alloc_uninit    0
+#define alloc_clear     1
+#define alloc_untouched 2
+
+/* Mappings of at least this size are aligned to huge pages if
+   ND_MMAP_HUGEPAGE is set. */
+
+#define huge_page_bytes (2*1024*1024)
+
+/* Shapes of ranks below small_rank created from variadic arguments
+   are kept on the stack. */
+
+#define small_rank 8
+
+#ifdef NDMALLOC_NO_REGISTRY
+/* The canary is keyed with a process secret, seeded once from the
+   kernel's random source where available, the time, the process id
+   and the addresses of this object and of the stack, so that it
+   differs between runs even without address space randomization.  It
+   is not meant to be cryptographically strong, only to make it
+   unlikely that arbitrary memory passes as a header. */
+static const char canary_secret_anchor = 0;
+static size_t     canary_secret = 0; /* 0 until seeded */
+#ifdef ND_HAVE_PTHREADS
+static pthread_once_t canary_once = PTHREAD_ONCE_INIT;
+#endif
+#endif
 
 /* Define an alignment policy, such that the headers and the actual
    data are a multiple of mem_align_bytes apart. Note that the only
@@ -47,12 +284,160 @@ static short view_magic_mark = 0x1973; /* in headers of views on arrays  */
                           /mem_align_bytes)*mem_align_bytes)
 #define header_ptr_size  (header_size/sizeof(char*))
 
+/* In single blocks, the data is placed block_align_bytes-aligned, as
+   malloc would have done if the data was allocated separately. */
+
+#define block_align_bytes (2*sizeof(char*))
+#define batch_header_size (((sizeof(struct nd_internal_batch) \
+                           +block_align_bytes-1)/block_align_bytes) \
+                          *block_align_bytes)
+
 /***************************************************************************/
 
 /*
  * INTERNAL ROUTINES
  */
 
+static void* nd_internal_get_data(void* ptr, short rank);
+
+/***************************************************************************/
+
+#ifdef ND_HAVE_MMAP
+
+static 
+void* nd_internal_map_memory(size_t nbytes, int flags, size_t* maplength)
+{
+ /* Allocate 'nbytes' of zeroed memory with an anonymous memory
+    mapping, using the ND_MMAP_* 'flags', and store the length of the
+    mapping in '*maplength'. The pages are not touched unless
+    ND_MMAP_POPULATE or ND_MMAP_LOCK is set. */
+
+    size_t  page, align, length, extra;
+    char*   addr;
+    char*   start;
+    char*   p;
+
+    page = (size_t)sysconf(_SC_PAGESIZE);
+    length = (nbytes + page - 1)/page*page;
+    align = page;
+    if ((flags & ND_MMAP_HUGEPAGE) && length >= huge_page_bytes 
+        && huge_page_bytes > page)
+        align = huge_page_bytes;
+    /* map more than needed if stricter alignment is needed, and
+       unmap the excess at both ends */
+    extra = align - page;
+    addr = mmap(NULL, length + extra, PROT_READ|PROT_WRITE, 
+                MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+        return NULL;
+    start = (char*)(((size_t)addr + align - 1) & ~(align - 1));
+    if (start > addr)
+        (void)munmap(addr, start - addr);
+    if (addr + length + extra > start + length)
+        (void)munmap(start + length, addr + length + extra - (start + length));
+#ifdef MADV_HUGEPAGE
+    if (flags & ND_MMAP_HUGEPAGE)
+        (void)madvise(start, length, MADV_HUGEPAGE);
+#endif
+    if (flags & ND_MMAP_POPULATE) {
+        /* prefault after madvise, so huge pages get used */
+#ifdef MADV_POPULATE_WRITE
+        if (madvise(start, length, MADV_POPULATE_WRITE) != 0)
+#endif
+            for (p = start; p < start + length; p += page)
+                *(volatile char*)p = 0;
+    }
+    if (flags & ND_MMAP_LOCK)
+        (void)mlock(start, length); /* best effort */
+    *maplength = length;
+    return start;
+}
+
+#endif
+
+/***************************************************************************/
+
+static 
+const ndallocator_t* nd_internal_allocator(int which)
+{
+ /* Get the allocator currently in use in this thread for data, if
+    'which' is ND_ALLOC_DATA, or for metadata, if it is ND_ALLOC_META. */
+
+#ifdef ND_THREAD_LOCAL
+    if (which == ND_ALLOC_DATA) {
+        if (thread_data_allocator != NULL)
+            return thread_data_allocator;
+    } else if (thread_meta_allocator != NULL)
+        return thread_meta_allocator;
+#endif
+    return (which == ND_ALLOC_DATA) ? data_allocator : meta_allocator;
+}
+
+/***************************************************************************/
+
+static 
+void* nd_internal_alloc_memory(size_t nbytes, int clear, int which, 
+                               size_t* maplength, 
+                               const ndallocator_t** allocator)
+{
+ /* Allocate 'nbytes' of memory, initialized according to 'clear',
+    which is alloc_uninit, alloc_clear or alloc_untouched.  If
+    mmap_threshold is set and 'nbytes' reaches it, or if untouched
+    memory is requested, the memory is mapped and '*maplength' is set
+    to the length of the mapping; otherwise '*maplength' is set to
+    zero, and the memory comes from the current allocator for 'which'
+    (ND_ALLOC_DATA or ND_ALLOC_META), which is stored in '*allocator'. */
+
+    const ndallocator_t*  a;
+    void*                 mem;
+
+    *maplength = 0;
+    *allocator = NULL;
+#ifdef ND_HAVE_MMAP
+    if (clear == alloc_untouched)
+        return nd_internal_map_memory(nbytes, mmap_flags & ND_MMAP_HUGEPAGE,
+                                      maplength);
+    if (mmap_threshold != 0 && nbytes >= mmap_threshold)
+        return nd_internal_map_memory(nbytes, mmap_flags, maplength);
+#endif
+    a = nd_internal_allocator(which);
+    if (a == NULL) {
+        if (clear)
+            return calloc(1, nbytes);
+        else
+            return malloc(nbytes);
+    }
+    *allocator = a;
+    if (clear && a->calloc_fn != NULL)
+        return a->calloc_fn(1, nbytes, a->ctx);
+    mem = a->malloc_fn(nbytes, a->ctx);
+    if (clear && mem != NULL)
+        memset(mem, 0, nbytes);
+    return mem;
+}
+
+/***************************************************************************/
+
+static 
+void nd_internal_free_memory(void* base, size_t maplength, 
+                             const ndallocator_t* allocator)
+{
+ /* Release memory allocated by nd_internal_alloc_memory. */
+
+#ifdef ND_HAVE_MMAP
+    if (maplength != 0) {
+        (void)munmap(base, maplength);
+        return;
+    }
+#else
+    (void)maplength;
+#endif
+    if (allocator != NULL)
+        allocator->free_fn(base, allocator->ctx);
+    else
+        free(base);
+}
+
 /***************************************************************************/
  
 static 
@@ -63,13 +448,132 @@ struct header* nd_internal_get_header_address(const void* array)
     return array==NULL?0:((struct header*)((char*)array - header_size));
 }
 
+/***************************************************************************/
+
+#ifdef NDMALLOC_NO_REGISTRY
+
+static 
+void nd_internal_seed_canary(void)
+{
+ /* Seed the process secret of the canaries. */
+
+    size_t  seed;
+#if defined(ND_HAVE_MMAP) && defined(SYS_getrandom)
+    size_t  random;
+#endif
+
+    seed = (size_t)&canary_secret_anchor ^ ((size_t)&seed << 7);
+    seed ^= (size_t)time(NULL) * 0x9e3779b9UL;
+    seed ^= (size_t)clock() << 17;
+#ifdef ND_HAVE_MMAP
+    seed ^= (size_t)getpid() * 0x45d9f3bUL;
+#ifdef SYS_getrandom
+    if (syscall(SYS_getrandom, &random, sizeof(random), 0) 
+        == (long)sizeof(random))
+        seed ^= random;
+#endif
+#endif
+    seed ^= seed >> 16;
+    seed *= 0x45d9f3bUL;
+    seed ^= seed >> 15;
+    canary_secret = (seed != 0) ? seed : 1;
+}
+
+/***************************************************************************/
+
+static 
+size_t nd_internal_canary(const void* array, const struct header* hdr)
+{
+ /* Compute the canary for the header 'hdr' of 'array': the address
+    xor-ed with the process secret, plus a checksum of the rank, magic
+    mark, shape pointer, element size, flags and depth.  Only fields
+    inside the header are used, so that checking an arbitrary pointer
+    reads nothing beyond the header. */
+
+    size_t check;
+
+#ifdef ND_HAVE_PTHREADS
+    pthread_once(&canary_once, nd_internal_seed_canary);
+#else
+    if (canary_secret == 0)
+        nd_internal_seed_canary();
+#endif
+    check = (size_t)hdr->rank * 31 + (size_t)(unsigned short)hdr->magic;
+    check = check*31 + (size_t)hdr->shape;
+    check = check*31 + hdr->size;
+    check = check*31 + (size_t)(unsigned short)hdr->flags;
+    check = check*31 + (size_t)hdr->depth;
+    check ^= check >> 17;
+
+    return (((size_t)array) ^ canary_secret) + check*0x45d9f3bUL;
+}
+
+#endif
+
+/***************************************************************************/
+
+static 
+int nd_internal_check_header(const void* array, struct header* hdr)
+{
+ /* Check that 'hdr', whose magic mark has been checked already, is a
+    valid header of 'array': either 'array' is in the registry, or, in
+    registry-free mode, the header holds the right canary. */
+
+#ifdef NDMALLOC_NO_REGISTRY
+    return hdr->shape != NULL
+        && ((size_t)hdr->shape) % sizeof(size_t) == 0
+        && hdr->canary == nd_internal_canary(array, hdr);
+#else
+    return ndreg_lookup(array, &(hdr->clue)) == NDREG_SUCCESS;
+#endif
+}
+
+/***************************************************************************/
+ 
+static 
+void nd_internal_clear_header(void* array)
+{
+ /* Invalidate the header of 'array' before its memory is released or
+    moved, so that stale pointers are no longer recognized. */
+
+#ifdef NDMALLOC_NO_REGISTRY
+    struct header* hdr;
+
+    hdr = nd_internal_get_header_address(array);
+    if (hdr != NULL)
+        hdr->canary = 0;
+#else
+    (void)array;
+#endif
+}
+
+/***************************************************************************/
+ 
+static 
+void nd_internal_seal_header(void* array)
+{
+ /* Recompute the canary of 'array' after a field it covers has
+    changed. */
+
+#ifdef NDMALLOC_NO_REGISTRY
+    struct header* hdr;
+
+    hdr = nd_internal_get_header_address(array);
+    hdr->canary = nd_internal_canary(array, hdr);
+#else
+    (void)array;
+#endif
+}
+
 /***************************************************************************/
  
 static 
 void nd_internal_create_header( void*      array,
                                 short      rank,
                                 size_t*    shape,
+                                size_t     size,
                                 short      mark,
+                                short      flags,
                                 ndreg_int  clue )
 {  
  /* Prepend a pointer with a header */
@@ -79,8 +583,154 @@ void nd_internal_create_header( void*      array,
     hdr = nd_internal_get_header_address(array);
     hdr->clue  = clue;
     hdr->rank  = rank;
+    hdr->depth = (rank > 1) ? rank-1 : 0;
     hdr->magic = mark;
     hdr->shape = shape;
+    hdr->size  = size;
+    hdr->flags = flags;
+    hdr->origin = 0;
+    hdr->halo = 0;
+#ifdef NDMALLOC_NO_REGISTRY
+    hdr->canary = nd_internal_canary(array, hdr);
+#endif
+}
+
+/***************************************************************************/
+ 
+static 
+size_t nd_internal_table_length(short rank, const size_t* shape)
+{
+ /* Number of pointers in the pointer-to-pointer structure */
+
+    short   i;
+    size_t  nalloc;    
+
+    nalloc = 0;
+    for (i = rank-1; i--; )
+        nalloc = shape[i]*(1+nalloc);
+
+    return nalloc;
+}
+
+/***************************************************************************/
+ 
+static 
+void nd_internal_fill_rows( char**         palloc,
+                            void*          data, 
+                            size_t         size, 
+                            short          rank, 
+                            const size_t*  shape,
+                            size_t         pitch,
+                            size_t         n0,
+                            size_t         lo,
+                            size_t         hi )
+{
+ /* Fill the part of the pointer-to-pointer structure for rank>1 in
+    the memory at 'palloc' that belongs to the rows 'lo' to 'hi'-1 of
+    the first dimension.  Rows of the last dimension start 'pitch'
+    elements apart in 'data'.  The structure is laid out for 'n0'
+    rows of the first dimension, which is shape[0] unless capacity
+    was reserved. */
+
+    short   i;
+    size_t  j, nrow, ntot;
+    char**  level;
+    char**  next;
+
+    level = palloc;
+    nrow = 1;         /* entries per row of the first dimension */
+    ntot = n0;        /* entries in this level */
+    for (i = 0; i < rank - 1; i++) {
+        next = level + ntot;
+        if (i < rank - 2) {
+            for (j = lo*nrow; j < hi*nrow; j++)
+                level[j] = (char*)(next + j*shape[i+1]);
+        } else {
+            for (j = lo*nrow; j < hi*nrow; j++)
+                level[j] = (char*)data + size*j*pitch;
+        }
+        level = next;
+        nrow *= shape[i+1];
+        ntot *= shape[i+1];
+    }
+}
+
+/***************************************************************************/
+ 
+static 
+void* nd_internal_fill_array( char**         palloc,
+                              void*          data, 
+                              size_t         size, 
+                              short          rank, 
+                              const size_t*  shape,
+                              size_t         pitch )
+{
+ /* Fill the pointer-to-pointer structure for rank>1 in the memory at
+    'palloc', which must hold nd_internal_table_length(rank, shape)
+    pointers.  Rows of the last dimension start 'pitch' elements
+    apart in 'data'.  Ranks 2 and 3 are done without the general
+    loop over levels. */
+
+    size_t  i, j, n, rowbytes;
+    char*   row;
+    char**  next;
+
+    rowbytes = size*pitch;
+    if (rank == 2) {
+        row = (char*)data;
+        for (i = 0; i < shape[0]; i++, row += rowbytes)
+            palloc[i] = row;
+    } else if (rank == 3) {
+        n = shape[1];
+        next = palloc + shape[0];
+        row = (char*)data;
+        for (i = 0; i < shape[0]; i++, next += n) {
+            palloc[i] = (char*)next;
+            for (j = 0; j < n; j++, row += rowbytes)
+                next[j] = row;
+        }
+    } else
+        nd_internal_fill_rows(palloc, data, size, rank, shape, pitch, 
+                              shape[0], 0, shape[0]);
+
+    return (void*)palloc;
+}
+
+/***************************************************************************/
+ 
+static 
+char** nd_internal_alloc_table(size_t ntable)
+{
+ /* Allocate the memory for a pointer-to-pointer structure of 'ntable'
+    pointers, with a header in front of it.  The pointers are not
+    filled in. */
+
+    char**                palloc;
+    size_t                maplength;
+    const ndallocator_t*  allocator;
+
+    palloc = (char**)nd_internal_alloc_memory(
+               (ntable + header_ptr_size)*sizeof(char*), 
+               1, ND_ALLOC_META, &maplength, &allocator);
+    if (palloc == NULL)
+        return NULL;
+    ((struct header*)palloc)->base = palloc;
+    ((struct header*)palloc)->maplength = maplength;
+    ((struct header*)palloc)->allocator = allocator;
+    return palloc + header_ptr_size;
+}
+
+/***************************************************************************/
+ 
+static 
+void nd_internal_free_table(char** table)
+{
+ /* Release the memory of a pointer table from nd_internal_alloc_table
+    that has no header of an array yet. */
+
+    nd_internal_free_memory(nd_internal_get_header_address(table)->base,
+                            nd_internal_get_header_address(table)->maplength,
+                            nd_internal_get_header_address(table)->allocator);
 }
 
 /***************************************************************************/
@@ -90,16 +740,14 @@ void* nd_internal_create_array( void*       data,
                                 size_t      size, 
                                 short       rank, 
                                 size_t*     shape, 
+                                size_t      pitch,
                                 ndreg_int*  clue )
 {
- /* Create the pointer-to-pointer structure for any rank */
+ /* Create the pointer-to-pointer structure for any rank, with rows
+    of the data 'pitch' elements apart. */
 
-    short   i;
-    size_t  j, ntot;
-    size_t  nalloc;    
-    char**  palloc;
-    char**  result;
-    char*** ptr;
+    char**                palloc;
+    void*                 result;
 
     if (rank <= 1) {
         
@@ -110,29 +758,12 @@ void* nd_internal_create_array( void*       data,
        
     } else {
                 
-        nalloc = 0;
-        for (i = rank-1; i--; )
-            nalloc = shape[i]*(1+nalloc);
-        
-        palloc = (char**)calloc(nalloc + header_ptr_size, sizeof(char*));
+        palloc = nd_internal_alloc_table(nd_internal_table_length(rank, shape));
         if (palloc == NULL)
             return NULL;
-        palloc += header_ptr_size;
-        
-        ntot = 1;   
-        ptr = &result;
-        for (i = 0; i < rank - 1; i++) {    
-            for (j = 0; j < ntot; j++)
-                ptr[j] = palloc + j*shape[i];      
-            ptr = (char***)(*ptr);
-            ntot *= shape[i];
-            palloc += ntot;
-        }
-        for (j = 0; j < ntot; j++)
-            ptr[j] = (char**)((char*)data 
-                              + size*j*shape[rank-1]);
+        result = nd_internal_fill_array(palloc, data, size, rank, shape, pitch);
         (void)ndreg_add(result, clue); /* should check error status */
-        return (void*)result;
+        return result;
     }
 }
 
@@ -144,7 +775,10 @@ int nd_internal_destroy_array(void* ptr, ndreg_int clue)
  /* Release the memory allocated by nd_internal_create_array */
 
     if (ptr != NULL) {
-        free((char*)ptr - header_size);
+        nd_internal_clear_header(ptr);
+        nd_internal_free_memory(nd_internal_get_header_address(ptr)->base,
+                                nd_internal_get_header_address(ptr)->maplength,
+                                nd_internal_get_header_address(ptr)->allocator);
         return ndreg_remove(ptr, clue);
     } else 
         return NDREG_SUCCESS;
@@ -153,9 +787,11 @@ int nd_internal_destroy_array(void* ptr, ndreg_int clue)
 /***************************************************************************/
  
 static 
-size_t* nd_internal_create_shape(short rank, va_list arglist)
+size_t* nd_internal_create_shape(short rank, va_list arglist, size_t* buf)
 {
- /* Create a dimension array from a va_list */
+ /* Create a dimension array from a va_list.  If rank<small_rank, the
+    buffer 'buf' of small_rank+1 elements is used instead of
+    allocating memory. */
 
     size_t* shape;
     short   i;
@@ -163,7 +799,10 @@ size_t* nd_internal_create_shape(short rank, va_list arglist)
     size_t  n;
 
     if (rank > 1 ) {
-        shape = malloc(sizeof(size_t)*(rank+1));
+        if (rank < small_rank)
+            shape = buf;
+        else
+            shape = malloc(sizeof(size_t)*(rank+1));
         if (shape != NULL) {
             fullsize = 1;
             for (i = 0; i < rank; i++) {
@@ -174,9 +813,8 @@ size_t* nd_internal_create_shape(short rank, va_list arglist)
             shape[rank]=fullsize;
         }
     } else {
-        shape = malloc(sizeof(size_t));
-        if (shape != NULL)
-            shape[0] = va_arg(arglist, size_t);
+        shape = buf;
+        shape[0] = va_arg(arglist, size_t);
     }
 
     return shape;
@@ -185,27 +823,58 @@ size_t* nd_internal_create_shape(short rank, va_list arglist)
 /***************************************************************************/
 
 static 
-size_t* nd_internal_copy_shape(short rank, const size_t* from)
+void nd_internal_set_shape(short rank, const size_t* from, size_t* shape)
 {
- /* Copy a dimension array */
+ /* Copy the 'rank' dimensions in 'from' to 'shape', followed by the
+    total number of elements if rank>1. */
 
-    size_t* shape;
+    short  i;
+    size_t fullsize;
+
+    if (rank>1) {
+        fullsize = 1;
+        for (i = 0; i < rank; i++) { 
+            shape[i] = from[i];
+            fullsize *= from[i];
+        }
+        shape[rank] = fullsize;
+    } else 
+        shape[0] = from[0];
+}
+
+/***************************************************************************/
+
+static 
+const ndallocator_t* nd_internal_shape_allocator(short rank)
+{
+ /* Get the allocator for a copy of a shape of rank 'rank'.  Shapes
+    are metadata, except for rank 1, whose header is part of the
+    data, so that the allocator in the header of an array is always
+    the one of its shape. */
+
+    return nd_internal_allocator(rank > 1 ? ND_ALLOC_META : ND_ALLOC_DATA);
+}
+
+/***************************************************************************/
+
+static 
+size_t* nd_internal_copy_shape_using(short rank, const size_t* from, 
+                                     const ndallocator_t* a)
+{
+ /* Copy a dimension array, using the allocator 'a', which must be the
+    one that ends up in the header of its array. */
+
+    size_t*  shape;
 
     shape = NULL;
     if (from != NULL) {
-        if (rank>1) {
-            shape = malloc(sizeof(size_t)*(rank+1));
-            if (shape != NULL) {
-                short i;
-                for (i = 0; i < rank+1; i++) { 
-                    shape[i] = from[i];
-                }
-            }
-        } else {
-            shape = malloc(sizeof(size_t));    
-            if (shape != NULL) 
-                shape[0] = from[0];
-        }
+        if (a == NULL)
+            shape = malloc(sizeof(size_t)*(rank > 1 ? rank+1 : 1));
+        else
+            shape = a->malloc_fn(sizeof(size_t)*(rank > 1 ? rank+1 : 1), 
+                                 a->ctx);
+        if (shape != NULL) 
+            nd_internal_set_shape(rank, from, shape);
     }
 
     return shape;
@@ -214,17 +883,40 @@ size_t* nd_internal_copy_shape(short rank, const size_t* from)
 /***************************************************************************/
 
 static 
-void nd_internal_destroy_shape(size_t* ptr)
+size_t* nd_internal_copy_shape(short rank, const size_t* from)
+{
+ /* Copy a dimension array, using nd_internal_shape_allocator. */
+
+    return nd_internal_copy_shape_using(rank, from, 
+                                        nd_internal_shape_allocator(rank));
+}
+
+/***************************************************************************/
+
+static 
+void nd_internal_destroy_shape(size_t* ptr, const ndallocator_t* allocator)
+{
+ /* Release the memory allocated by nd_internal_copy_shape, with the
+    allocator in the header of its array. */
+
+    nd_internal_free_memory(ptr, 0, allocator);
+}
+
+/***************************************************************************/
+
+static 
+void nd_internal_destroy_va_shape(size_t* ptr, size_t* buf)
 {
  /* Release the memory allocated by nd_internal_create_shape */
 
-    free(ptr);
+    if (ptr != buf)
+        free(ptr);
 }
 
 /***************************************************************************/
  
 static 
-size_t nd_internal_fullsize_shape(short rank, size_t* ptr)
+size_t nd_internal_fullsize_shape(short rank, const size_t* ptr)
 {
  /* Determine total number of elements in a shape */
 
@@ -234,6 +926,27 @@ size_t nd_internal_fullsize_shape(short rank, size_t* ptr)
         return ptr[0];
 }
 
+/***************************************************************************/
+ 
+static 
+size_t nd_internal_memsize_shape(short rank, const size_t* shape, size_t pitch)
+{
+ /* Determine the number of elements of memory needed for the data of
+    an array with rows of the last dimension 'pitch' elements apart,
+    or contiguous if 'pitch' is zero.  Only the first 'rank' entries
+    of 'shape' are used. */
+
+    short   i;
+    size_t  nmemb;
+
+    if (rank <= 1)
+        return shape[0];
+    nmemb = (pitch != 0) ? pitch : shape[rank-1];
+    for (i = 0; i < rank-1; i++)
+        nmemb *= shape[i];
+    return nmemb;
+}
+
 /***************************************************************************/
 
 static 
@@ -241,11 +954,18 @@ void* nd_internal_create_data(size_t nmemb, size_t size)
 {
  /* Allocate uninitialized memory for data. */
 
-    char* data;
+    char*                 data;
+    size_t                maplength;
+    const ndallocator_t*  allocator;
 
-    data = malloc(nmemb*size + header_size);
-    if (data != NULL)
+    data = nd_internal_alloc_memory(nmemb*size + header_size, 0, 
+                                    ND_ALLOC_DATA, &maplength, &allocator);
+    if (data != NULL) {
+        ((struct header*)data)->base = data;
+        ((struct header*)data)->maplength = maplength;
+        ((struct header*)data)->allocator = allocator;
         data += header_size;
+    }
 
     return (void*)data;
 }
@@ -258,13 +978,53 @@ void* nd_internal_create_clear_data(size_t nmemb, size_t size)
  /* Allocate zero-initialized memory for data with any required extra
     space for bookkeeping. */
 
-    size_t chunks;
-    char*  data;
+    size_t                chunks;
+    char*                 data;
+    size_t                maplength;
+    const ndallocator_t*  allocator;
 
     chunks = (nmemb*size+header_size+mem_align_bytes-1)/mem_align_bytes;
-    data = calloc(chunks, mem_align_bytes);
-    if (data != NULL)
+    data = nd_internal_alloc_memory(chunks*mem_align_bytes, 1, ND_ALLOC_DATA,
+                                    &maplength, &allocator);
+    if (data != NULL) {
+        ((struct header*)data)->base = data;
+        ((struct header*)data)->maplength = maplength;
+        ((struct header*)data)->allocator = allocator;
         data += header_size;
+    }
+
+    return (void*)data;
+}
+
+/***************************************************************************/
+ 
+static 
+void* nd_internal_create_aligned_data(size_t nmemb, size_t size, 
+                                      size_t align, int clear)
+{
+ /* Allocate memory for data such that the data starts at a multiple
+    of 'align' bytes, which must be a power of two.  The memory is
+    over-allocated and the start of the allocation is kept in the
+    header. If 'clear' is nonzero, the data is zero-initialized. */
+
+    char*                 base;
+    char*                 data;
+    struct header*        hdr;
+    size_t                maplength;
+    const ndallocator_t*  allocator;
+
+    base = nd_internal_alloc_memory(nmemb*size + header_size + align - 1, 
+                                    clear, ND_ALLOC_DATA, &maplength, 
+                                    &allocator);
+    if (base == NULL)
+        return NULL;
+
+    data = (char*)(((size_t)(base + header_size) + align - 1) & ~(align - 1));
+    hdr = nd_internal_get_header_address(data);
+    hdr->base      = base;
+    hdr->align     = align;
+    hdr->maplength = maplength;
+    hdr->allocator = allocator;
 
     return (void*)data;
 }
@@ -278,10 +1038,65 @@ void* nd_internal_recreate_data(void* data, size_t nmemb, size_t size)
     bookkeeping, keeping old data values. */
 
     if (data != NULL) {
-        char* newdata = realloc((char*)data - header_size, 
-                                nmemb*size + header_size);
-        if (newdata != NULL)
+        char*          newdata;
+        struct header  saved;
+        size_t         nbytes;
+        saved = *nd_internal_get_header_address(data);
+#if defined(ND_HAVE_MMAP) && defined(MREMAP_MAYMOVE)
+        if (saved.maplength != 0 && saved.base == (char*)data - header_size) {
+            /* mappings are grown or shrunk by moving their pages
+               instead of copying the data */
+            size_t page = (size_t)sysconf(_SC_PAGESIZE);
+            size_t length = (nmemb*size + header_size + page - 1)/page*page;
+            newdata = mremap(saved.base, saved.maplength, length, 
+                             MREMAP_MAYMOVE);
+            if (newdata == MAP_FAILED)
+                return NULL;
+            ((struct header*)newdata)->base = newdata;
+            ((struct header*)newdata)->maplength = length;
+            return (void*)(newdata + header_size);
+        }
+#endif
+        if (saved.maplength != 0 
+            || (mmap_threshold != 0 && nmemb*size + header_size >= mmap_threshold)
+            || saved.allocator != nd_internal_allocator(ND_ALLOC_DATA)
+            || (saved.allocator != NULL && saved.allocator->realloc_fn == NULL)) {
+            /* mapped memory can not be realloc'ed (unless remapped
+               above), and neither can memory of another allocator, so
+               copy instead */
+            newdata = nd_internal_create_data(nmemb, size);
+            if (newdata != NULL) {
+                struct header* hdr = nd_internal_get_header_address(newdata);
+                nbytes = saved.shape[0]*saved.size;
+                if (nbytes > nmemb*size)
+                    nbytes = nmemb*size;
+                memcpy(newdata, data, nbytes);
+                /* keep the old header like realloc would */
+                saved.base      = hdr->base;
+                saved.maplength = hdr->maplength;
+                saved.allocator = hdr->allocator;
+                nd_internal_clear_header(data);
+                nd_internal_free_memory(nd_internal_get_header_address(data)->base,
+                                        nd_internal_get_header_address(data)->maplength,
+                                        nd_internal_get_header_address(data)->allocator);
+                *hdr = saved;
+            }
+            return (void*)newdata;
+        }
+        nd_internal_clear_header(data);
+        if (saved.allocator != NULL)
+            newdata = saved.allocator->realloc_fn((char*)data - header_size, 
+                                                  nmemb*size + header_size,
+                                                  saved.allocator->ctx);
+        else
+            newdata = realloc((char*)data - header_size, 
+                              nmemb*size + header_size);
+        if (newdata != NULL) {
+            ((struct header*)newdata)->base = newdata;
+            ((struct header*)newdata)->maplength = 0;
             newdata += header_size;
+        } else
+            *nd_internal_get_header_address(data) = saved;
         return (void*)newdata;
     } else
         return nd_internal_create_data(nmemb,size);
@@ -293,477 +1108,3698 @@ static
 void nd_internal_destroy_data(void* data)
 {
  /* Release the memory allocated by nd_internal_create_data,
-    nd_internal_recreate_data, or nd_internal_create_clear__data */
-
-    if (data!=NULL)
-        free((char*)data - header_size);
+    nd_internal_recreate_data, nd_internal_create_clear_data or
+    nd_internal_create_aligned_data */
+
+    if (data!=NULL) {
+        nd_internal_clear_header(data);
+        nd_internal_free_memory(nd_internal_get_header_address(data)->base,
+                                nd_internal_get_header_address(data)->maplength,
+                                nd_internal_get_header_address(data)->allocator);
+    }
 }
 
 /***************************************************************************/
- 
+
 static 
-void* nd_internal_get_data(void* ptr, short rank)
+size_t nd_internal_block_offset(short rank, const size_t* shape, 
+                                size_t* ntable)
 {
- /* Get the pointer to the data for an ndmalloc array. */
+ /* Determine the minimal offset of the data from the start of a single
+    block holding the shape, header, pointer table, data header and
+    data of an nd array, and the number of pointers in its table. */
 
-    void** result;
-    short  i;
-
-    result = ptr;
-    for (i = 0; i < rank-1; i++) 
-        result = (void**)(*result);
+    size_t nshape, offset;
 
-    return (void*)result;
+    /* size of the shape array, padded to keep the pointers aligned */
+    nshape = ((rank > 1 ? rank+1 : 1)*sizeof(size_t) + mem_align_bytes-1)
+             /mem_align_bytes*mem_align_bytes;
+    *ntable = (rank > 1) ? nd_internal_table_length(rank, shape) : 0;
+    offset = nshape + header_size;
+    if (rank > 1)
+        offset += *ntable*sizeof(char*) + header_size;
+    return offset;
 }
 
 /***************************************************************************/
 
 static 
-const void* nd_internal_get_cdata(const void* ptr, short rank)
+void* nd_internal_place_block(char* block, char* data, size_t size, 
+                              short rank, const size_t* shape, size_t ntable,
+                              size_t align, size_t pitch, short flags, 
+                              int fill)
 {
- /* Const version of nd_internal_get_data ('const' really is contagious). */
-
-    void const*const* result;
-    short i;
-    
-    result = ptr;
-    for (i = 0; i < rank-1; i++) 
-        result = (void const*const*)(*result);
+ /* Lay out an nd array in the memory at 'block', with its data at
+    'data', which must be at least nd_internal_block_offset bytes
+    further.  The shape goes at the start of the block, and the
+    header, pointer table and data header right before the data. If
+    'fill' is zero, the caller fills the pointer table. The array is
+    not registered. */
+
+    size_t*  shapecopy;
+    void*    array;
+
+    shapecopy = (size_t*)block;
+    nd_internal_set_shape(rank, shape, shapecopy);
+    if (pitch == 0)
+        pitch = shapecopy[rank > 1 ? rank-1 : 0];
+    if (rank > 1)
+        array = data - header_size - ntable*sizeof(char*);
+    else
+        array = data;
+
+    if (rank > 1) {
+        if (fill)
+            (void)nd_internal_fill_array((char**)array, data, size, rank, 
+                                         shapecopy, pitch);
+        nd_internal_create_header(data, 1, shapecopy+rank, size,
+                                  view_magic_mark, flags, NDREG_NOCLUE);
+        nd_internal_get_header_address(data)->base      = block;
+        nd_internal_get_header_address(data)->align     = align;
+        nd_internal_get_header_address(data)->maplength = 0;
+        nd_internal_get_header_address(data)->allocator = NULL;
+    }
+    nd_internal_create_header(array, rank, shapecopy, size, magic_mark, 
+                              flags, NDREG_NOCLUE);
+    nd_internal_get_header_address(array)->base      = block;
+    nd_internal_get_header_address(array)->align     = align;
+    nd_internal_get_header_address(array)->pitch     = pitch;
+    nd_internal_get_header_address(array)->maplength = 0;
+    nd_internal_get_header_address(array)->allocator = NULL;
 
-    return (const void*)result;
+    return array;
 }
 
 /***************************************************************************/
 
-/*
- * IMPLEMENTATION OF THE INTERFACE
- */
-
-/***************************************************************************/
-
-void* sndmalloc(size_t size, short rank, const size_t* shape)
+static 
+void* nd_internal_create_block(size_t size, short rank, const size_t* shape, 
+                               size_t align, size_t pitch, int clear)
 {
- /* Create a dynamically allocated multi- dimensional array of
-    dimensions n[0] x n[1] ... x n['rank'-1], with elements of 'size'
-    bytes.  The dimensions are given as the variable-length arguments.
-    The function allocates 'size'*n[0]*n[1]*..n['rank'-1] bytes for
-    the data, plus another n[0]*n[1]*...n[rank-2] *sizeof(void*) bytes
-    for the pointer-to-pointer structure that is common for c-style
-    arrays.  It also allocates internal buffers of moderate size.  The
-    pointer-to-pointer structure assumes that all pointers are the
-    same size.  The return value can be cast to a TYPE* for an array
-    of rank 1, TYPE** for rank 2, T*** for rank 3, etc.  .This casted
-    pointer can then be used in the same way a c-style array is used,
-    i.e., with repeated square bracket indexing.  If the memory
-    allocation fails, a NULL pointer is returned.  The return value
-    (or its casted version) can be used in calls to 'ndrealloc',
-    'ndfree', 'ndsize', 'nddata', 'ndrank', 'ndshape', 'ndisknown'.
-    This works because an internal header containing the information
-    about the multi-dimensional structure is associated with each
-    dynamicaly allocated multi-dimensional array. */
+ /* Create an nd array whose shape, header, pointer table, data header
+    and data are all placed in one contiguous block of memory, in that
+    order, and register it.  The data starts at a multiple of 'align'
+    bytes, or of block_align_bytes if 'align' is zero. Rows are
+    'pitch' elements apart, or contiguous if 'pitch' is zero. If
+    'clear' is alloc_clear, the memory is zero-initialized, and if it
+    is alloc_untouched, the pointers are left for the caller to fill. */
+
+    size_t                ntable, offset, total, maplength;
+    short                 flags;
+    char*                 block;
+    char*                 data;
+    void*                 array;
+    const ndallocator_t*  allocator;
+    ndreg_int             clue = NDREG_NOCLUE;
+
+    flags = single_block_flag;
+    if (align != 0)
+        flags |= aligned_flag;
+    else
+        align = block_align_bytes;
+    if (pitch != 0)
+        flags |= pitched_flag;
+    offset = nd_internal_block_offset(rank, shape, &ntable);
+    total = offset + align - 1 
+            + nd_internal_memsize_shape(rank, shape, pitch)*size;
+
+    block = nd_internal_alloc_memory(total, clear, ND_ALLOC_DATA, 
+                                     &maplength, &allocator);
+    if (block == NULL)
+        return NULL;
+
+    data = (char*)(((size_t)(block + offset) + align - 1) & ~(align - 1));
+    array = nd_internal_place_block(block, data, size, rank, shape, ntable,
+                                    align, pitch, flags, 
+                                    clear != alloc_untouched);
+    nd_internal_get_header_address(array)->maplength = maplength;
+    nd_internal_get_header_address(array)->allocator = allocator;
+    nd_internal_get_header_address(data)->maplength = maplength;
+    nd_internal_get_header_address(data)->allocator = allocator;
+
+    if (rank > 1) {
+        if (ndreg_add(data, &clue) != NDREG_SUCCESS) {
+            nd_internal_free_memory(block, maplength, allocator);
+            return NULL;
+        }
+        nd_internal_get_header_address(data)->clue = clue;
+    }
+    if (ndreg_add(array, &clue) != NDREG_SUCCESS) {
+        if (rank > 1)
+            ndreg_remove(data, nd_internal_get_header_address(data)->clue);
+        nd_internal_free_memory(block, maplength, allocator);
+        return NULL;
+    }
+    nd_internal_get_header_address(array)->clue = clue;
+
+    return array;
+}
+
+/***************************************************************************/
+ 
+static 
+void* nd_internal_get_data(void* ptr, short rank)
+{
+ /* Get the pointer to the data for an ndmalloc array. */
+
+    struct header*  hdr;
+    void**          result;
+    short           i;
+
+    result = ptr;
+    if (rank > 1) {
+        /* the first row is elsewhere if the rows were reordered */
+        hdr = nd_internal_get_header_address(ptr);
+        if (hdr->flags & permuted_flag)
+            result = (void**)result[hdr->origin];
+        else
+            result = (void**)(*result);
+    }
+    for (i = 1; i < rank-1; i++) 
+        result = (void**)(*result);
+
+    return (void*)result;
+}
+
+/***************************************************************************/
+
+static 
+const void* nd_internal_get_cdata(const void* ptr, short rank)
+{
+ /* Const version of nd_internal_get_data ('const' really is contagious). */
+
+    void const*const* result;
+    const struct header* hdr;
+    short i;
+    
+    result = ptr;
+    if (rank > 1) {
+        hdr = nd_internal_get_header_address(ptr);
+        if (hdr->flags & permuted_flag)
+            result = (void const*const*)result[hdr->origin];
+        else
+            result = (void const*const*)(*result);
+    }
+    for (i = 1; i < rank-1; i++) 
+        result = (void const*const*)(*result);
+
+    return (const void*)result;
+}
+
+/***************************************************************************/
+
+static 
+size_t nd_internal_auto_pitch(size_t size, size_t n)
+{
+ /* Choose a pitch for rows of 'n' elements of 'size' bytes: rows are
+    padded to whole cache lines, plus one more cache line if the row
+    length would be a multiple of 512 bytes, as rows that far apart
+    map onto the same few cache sets. */
+
+    size_t step, a, b, t;
+
+    /* step = smallest number of elements that fills whole cache lines */
+    a = size;
+    b = cache_line_bytes;
+    while (b != 0) {
+        t = a % b;
+        a = b;
+        b = t;
+    }
+    step = cache_line_bytes/a;
+    n = (n + step - 1)/step*step;
+    if ((n*size) % 512 == 0)
+        n += step;
+    return n;
+}
+
+/***************************************************************************/
+
+static 
+void nd_internal_copy_rows(char* dst, size_t dstrow, size_t dstpitch,
+                           const char* src, size_t srcrow, size_t srcpitch,
+                           size_t nbytes)
+{
+ /* Copy the first 'nbytes' bytes of the data in 'src' to 'dst', in
+    row-major order, skipping the padding of pitched data. Rows have
+    'srcrow' and 'dstrow' bytes of data, and start 'srcpitch' and
+    'dstpitch' bytes apart. */
+
+    size_t i, j, m;
+
+    if (srcrow == srcpitch && dstrow == dstpitch) {
+        memcpy(dst, src, nbytes);
+        return;
+    }
+    i = 0;
+    j = 0;
+    while (nbytes > 0) {
+        m = nbytes;
+        if (m > srcrow - i)
+            m = srcrow - i;
+        if (m > dstrow - j)
+            m = dstrow - j;
+        memcpy(dst + j, src + i, m);
+        nbytes -= m;
+        i += m;
+        j += m;
+        if (i == srcrow) {
+            src += srcpitch;
+            i = 0;
+        }
+        if (j == dstrow) {
+            dst += dstpitch;
+            j = 0;
+        }
+    }
+}
+
+/***************************************************************************/
+
+static 
+int nd_internal_detach(void* ptr, struct nd_internal_block* blocks)
+{
+ /* Unregister the known nd array 'ptr', which is not a 1d view, and
+    invalidate its headers.  The memory blocks that still have to be
+    released, at most three and none for all but the last array of a
+    batch, are stored in 'blocks', and their number is returned. */
+
+    struct header*  hdr;
+    struct header*  datahdr;
+    void*           data;
+    int             n;
+
+    hdr = nd_internal_get_header_address(ptr);
+    n = 0;
+    /* single blocks hold the shape and, unless a view, the data */
+    if ((hdr->flags & single_block_flag) == 0) {
+        blocks[n].base      = hdr->shape;
+        blocks[n].maplength = 0;
+        blocks[n].allocator = hdr->allocator;
+        n++;
+    }
+    /* for rank==1 data and array are the same */
+    /* views should not have their data freed */
+    if ( (hdr->rank > 1) && ((hdr->magic & 1) == 0) ) {
+        data = nd_internal_get_data(ptr, hdr->depth+1);
+        datahdr = nd_internal_get_header_address(data);
+        ndreg_remove(data, datahdr->clue);
+        nd_internal_clear_header(data);
+        if ((hdr->flags & single_block_flag) == 0) {
+            blocks[n].base      = datahdr->base;
+            blocks[n].maplength = datahdr->maplength;
+            blocks[n].allocator = datahdr->allocator;
+            n++;
+        }
+    }
+    ndreg_remove(ptr, hdr->clue);
+    nd_internal_clear_header(ptr);
+    /* a batch is released with its last array */
+    if ((hdr->flags & batch_flag) && nd_internal_batch_release(hdr->base) != 0)
+        return n;
+    blocks[n].base      = hdr->base;
+    blocks[n].maplength = hdr->maplength;
+    blocks[n].allocator = hdr->allocator;
+    n++;
+    return n;
+}
+
+/***************************************************************************/
+
+static 
+void nd_internal_free(void* ptr)
+{
+ /* Free up all the memory of the known nd array 'ptr', which is not
+    a 1d view. */
+
+    struct nd_internal_block  blocks[3];
+    int                       i, n;
+
+    n = nd_internal_detach(ptr, blocks);
+    for (i = 0; i < n; i++)
+        nd_internal_free_memory(blocks[i].base, blocks[i].maplength, 
+                                blocks[i].allocator);
+}
+
+/***************************************************************************/
+
+#ifdef ND_HAVE_PTHREADS
+
+static 
+void* nd_internal_reclaim(void* arg)
+{
+ /* Body of the background thread that releases the blocks in the
+    reclaim queue. It runs until the program ends. */
+
+    struct nd_internal_block  block;
+
+    (void)arg;
+    pthread_mutex_lock(&reclaim_mutex);
+    for (;;) {
+        while (reclaim_count == 0) {
+            reclaim_busy = 0;
+            pthread_cond_broadcast(&reclaim_idle);
+            pthread_cond_wait(&reclaim_work, &reclaim_mutex);
+        }
+        block = reclaim_queue[reclaim_head];
+        reclaim_head = (reclaim_head + 1) % reclaim_slots;
+        reclaim_count--;
+        reclaim_busy = 1;
+        pthread_cond_broadcast(&reclaim_space);
+        pthread_mutex_unlock(&reclaim_mutex);
+        nd_internal_free_memory(block.base, block.maplength, block.allocator);
+        pthread_mutex_lock(&reclaim_mutex);
+    }
+    return NULL;
+}
+
+#endif
+
+/***************************************************************************/
+
+static 
+void nd_internal_free_deferred(void* ptr)
+{
+ /* Unregister the known nd array 'ptr', which is not a 1d view, and
+    queue its memory to be released by the background thread.  If
+    the queue is full, wait until the thread has taken enough blocks
+    out of it.  If there is no thread, or this is the thread itself
+    (a user-supplied allocator freeing an nd array), the memory is
+    released right away. */
+
+    struct nd_internal_block  blocks[3];
+    int                       i, n;
+#ifdef ND_HAVE_PTHREADS
+    pthread_attr_t            attr;
+    int                       queued;
+#endif
+
+    n = nd_internal_detach(ptr, blocks);
+#ifdef ND_HAVE_PTHREADS
+    queued = 0;
+    pthread_mutex_lock(&reclaim_mutex);
+    if (! reclaim_started) {
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        reclaim_started = (pthread_create(&reclaim_thread, &attr, 
+                                          nd_internal_reclaim, NULL) == 0);
+        pthread_attr_destroy(&attr);
+    }
+    if (reclaim_started && ! pthread_equal(pthread_self(), reclaim_thread)) {
+        while (reclaim_count + n > reclaim_slots)
+            pthread_cond_wait(&reclaim_space, &reclaim_mutex);
+        for (i = 0; i < n; i++)
+            reclaim_queue[(reclaim_head + reclaim_count++) % reclaim_slots]
+              = blocks[i];
+        pthread_cond_signal(&reclaim_work);
+        queued = 1;
+    }
+    pthread_mutex_unlock(&reclaim_mutex);
+    if (queued)
+        return;
+#endif
+    for (i = 0; i < n; i++)
+        nd_internal_free_memory(blocks[i].base, blocks[i].maplength, 
+                                blocks[i].allocator);
+}
+
+/***************************************************************************/
+
+static 
+size_t nd_internal_cache_size(const struct header* hdr)
+{
+ /* Number of bytes that the array with header 'hdr' takes up in the
+    cache: its data plus its pointer table. */
+
+    size_t bytes;
+
+    bytes = nd_internal_fullsize_shape(hdr->rank, hdr->shape)*hdr->size;
+    if (hdr->rank > 1)
+        bytes += nd_internal_table_length(hdr->rank, hdr->shape)
+                 *sizeof(char*);
+    return bytes;
+}
+
+/***************************************************************************/
+
+static 
+void nd_internal_cache_release(size_t keepbytes, size_t keepslots)
+{
+ /* Free the oldest parked arrays until at most 'keepbytes' bytes in
+    at most 'keepslots' arrays remain parked.  The cache must be
+    locked. */
+
+    size_t n;
+
+    n = 0;
+    while (n < cache_nparked 
+           && (cache_bytes > keepbytes || cache_nparked - n > keepslots)) {
+        cache_bytes -= nd_internal_cache_size(
+                         nd_internal_get_header_address(cache_parked[n]));
+        nd_internal_free(cache_parked[n]);
+        n++;
+    }
+    if (n > 0) {
+        cache_nparked -= n;
+        memmove(cache_parked, cache_parked + n, cache_nparked*sizeof(void*));
+    }
+}
+
+/***************************************************************************/
+
+static 
+int nd_internal_cache_park(void* ptr)
+{
+ /* Park the known nd array 'ptr' in the cache instead of freeing it.
+    Only arrays that ndmalloc or ndcalloc could have returned are
+    parked, and only if they fit in the cache.  Returns 1 if 'ptr' was
+    parked and 0 if it still has to be freed. */
+
+    struct header*  hdr;
+    size_t          bytes;
+    int             parked;
+
+    hdr = nd_internal_get_header_address(ptr);
+    if (hdr->magic != magic_mark || (hdr->flags & ~single_block_flag) != 0)
+        return 0;
+    bytes = nd_internal_cache_size(hdr);
+    parked = 0;
+    nd_internal_cache_lock();
+    if (bytes <= cache_capacity) {
+        nd_internal_cache_release(cache_capacity - bytes, cache_slots - 1);
+        hdr->magic = parked_magic_mark;
+        if (hdr->rank > 1)
+            nd_internal_get_header_address(
+              nd_internal_get_data(ptr, hdr->depth+1))->magic = parked_magic_mark;
+        cache_parked[cache_nparked++] = ptr;
+        cache_bytes += bytes;
+        parked = 1;
+    }
+    nd_internal_cache_unlock();
+    return parked;
+}
+
+/***************************************************************************/
+
+static 
+int nd_internal_cache_fits(const void* array)
+{
+ /* Check whether the parked array 'array' came from the allocators
+    now in effect, so that handing it out again is the same as
+    allocating it anew.  Mapped memory does not come from the
+    allocators, so it fits any of them. */
+
+    const struct header*  hdr;
+    const struct header*  datahdr;
+
+    hdr = nd_internal_get_header_address(array);
+    datahdr = hdr;
+    if (hdr->rank > 1) {
+        datahdr = nd_internal_get_header_address(
+                    nd_internal_get_cdata(array, hdr->depth+1));
+        if ((hdr->flags & single_block_flag) == 0 && hdr->maplength == 0
+            && hdr->allocator != nd_internal_allocator(ND_ALLOC_META))
+            return 0;
+    }
+    return datahdr->maplength != 0 
+        || datahdr->allocator == nd_internal_allocator(ND_ALLOC_DATA);
+}
+
+/***************************************************************************/
+
+static 
+void* nd_internal_cache_take(size_t size, short rank, const size_t* shape,
+                            int clear)
+{
+ /* Take the most recently parked array with elements of 'size' bytes
+    and shape 'shape' that came from the allocators now in effect out
+    of the cache, and make it a known array again, with its data
+    zeroed if 'clear' is nonzero.  Returns NULL if there is no such
+    array. */
+
+    struct header*  hdr;
+    struct header*  datahdr;
+    void*           array;
+    size_t          k;
+    short           i, n;
+
+    array = NULL;
+    n = (rank > 1) ? rank : 1;
+    nd_internal_cache_lock();
+    for (k = cache_nparked; k-- > 0; ) {
+        hdr = nd_internal_get_header_address(cache_parked[k]);
+        if (hdr->size != size || hdr->rank != rank 
+            || ! nd_internal_cache_fits(cache_parked[k]))
+            continue;
+        for (i = 0; i < n; i++)
+            if (hdr->shape[i] != shape[i])
+                break;
+        if (i == n) {
+            array = cache_parked[k];
+            break;
+        }
+    }
+    if (array != NULL) {
+        cache_nparked--;
+        memmove(cache_parked + k, cache_parked + k + 1, 
+                (cache_nparked - k)*sizeof(void*));
+        cache_bytes -= nd_internal_cache_size(hdr);
+        cache_hits++;
+    } else
+        cache_misses++;
+    nd_internal_cache_unlock();
+
+    if (array != NULL) {
+        if (rank > 1) {
+            datahdr = nd_internal_get_header_address(
+                        nd_internal_get_data(array, rank));
+            nd_internal_create_header(nd_internal_get_data(array, rank), 1,
+                                      hdr->shape+rank, size, view_magic_mark,
+                                      datahdr->flags, datahdr->clue);
+        }
+        nd_internal_create_header(array, rank, hdr->shape, size, magic_mark,
+                                  hdr->flags, hdr->clue);
+        if (clear)
+            memset(nd_internal_get_data(array, rank), 0, 
+                   nd_internal_fullsize_shape(rank, hdr->shape)*size);
+    }
+    return array;
+}
+
+/***************************************************************************/
+
+static 
+void* nd_internal_malloc(size_t size, short rank, const size_t* shape, 
+                         size_t align, size_t pitch, int clear)
+{
+ /* Common implementation of sndmalloc, sndcalloc and their aligned
+    and pitched versions.  The data is aligned to 'align' bytes unless
+    'align' is zero, rows are 'pitch' elements apart unless 'pitch' is
+    zero, and the data is zero-initialized if 'clear' is nonzero. */
 
     size_t*     shapecopy;
     void*       array;
     void*       data;
     size_t      total_elements;
+    short       flags;
     ndreg_int   clue = NDREG_NOCLUE;
 
-    if (shape == NULL) 
+    if (shape == NULL) 
+        return NULL;
+
+    if (rank <= 1)
+        pitch = 0;
+
+    if (align == 0 && pitch == 0 && cache_capacity != 0) {
+        array = nd_internal_cache_take(size, rank, shape, clear);
+        if (array != NULL)
+            return array;
+    }
+
+    if (single_block_mode)
+        return nd_internal_create_block(size, rank, shape, align, pitch, clear);
+
+    shapecopy = nd_internal_copy_shape(rank, shape);  
+    if (shapecopy == NULL)
+       return NULL;
+
+    total_elements = nd_internal_memsize_shape(rank, shapecopy, pitch);
+
+    flags = (pitch != 0) ? pitched_flag : 0;
+    if (align != 0) {
+        data = nd_internal_create_aligned_data(total_elements, size, 
+                                               align, clear);
+        flags |= aligned_flag;
+    } else if (clear)
+        data = nd_internal_create_clear_data(total_elements, size);
+    else
+        data = nd_internal_create_data(total_elements, size);
+    if (data == NULL) {
+        nd_internal_destroy_shape(shapecopy, 
+                                  nd_internal_shape_allocator(rank));
+        return NULL;
+    }
+
+    if (pitch == 0)
+        pitch = shapecopy[rank > 1 ? rank-1 : 0];
+    array = nd_internal_create_array(data, size, rank, shapecopy, pitch, &clue);
+    if (array == NULL) {
+        nd_internal_destroy_shape(shapecopy, 
+                                  nd_internal_shape_allocator(rank));
+        nd_internal_destroy_data(data);
+    } else {
+        nd_internal_create_header(array, rank, shapecopy, size, magic_mark, flags, clue);
+        nd_internal_get_header_address(array)->pitch = pitch;
+        if (rank > 1) {
+            ndreg_add(data, &clue);
+            nd_internal_create_header(data, 1, shapecopy+rank, size, view_magic_mark, flags, clue);
+        }
+    }
+
+    return array;
+}
+
+/***************************************************************************/
+
+#ifdef ND_HAVE_MMAP
+
+struct nd_internal_touch_job {
+
+ /* Part of an array to be touched and filled by one thread in
+    sndcalloc_parallel. */
+
+    char**         table;     /* pointer-to-pointer structure     */
+    char*          data;      /* start of the data                */
+    size_t         size;      /* size of the elements in bytes    */
+    short          rank;      /* number of dimensions             */
+    const size_t*  shape;     /* dimensions                       */
+    size_t         rowbytes;  /* bytes per row of first dimension */
+    size_t         lo, hi;    /* rows of the first dimension      */
+#ifdef ND_HAVE_NUMA
+    int            pinned;    /* whether to run on 'cpus'         */
+    unsigned long  cpus[ND_MAX_CPUS/(8*sizeof(unsigned long))];
+#endif
+};
+
+/***************************************************************************/
+
+static 
+void* nd_internal_touch_rows(void* arg)
+{
+ /* Zero the data and fill the pointers of the rows of one job, so that
+    their pages are placed near the thread that touches them first. */
+
+    struct nd_internal_touch_job* job;
+
+    job = (struct nd_internal_touch_job*)arg;
+#ifdef ND_HAVE_NUMA
+    /* pages are placed on the node of the cpus that touch them first */
+    if (job->pinned)
+        (void)syscall(SYS_sched_setaffinity, 0, sizeof(job->cpus), job->cpus);
+#endif
+    if (job->hi > job->lo) {
+        memset(job->data + job->lo*job->rowbytes, 0, 
+               (job->hi - job->lo)*job->rowbytes);
+        if (job->rank > 1)
+            nd_internal_fill_rows(job->table, job->data, job->size, 
+                                  job->rank, job->shape, job->shape[job->rank-1],
+                                  job->shape[0], job->lo, job->hi);
+    }
+    return NULL;
+}
+
+/***************************************************************************/
+
+#ifdef ND_HAVE_NUMA
+
+static 
+int nd_internal_node_cpus(int node, unsigned long* cpus)
+{
+ /* Set the bits of the cpus of the NUMA node 'node' in 'cpus', which
+    has room for ND_MAX_CPUS bits, from its cpulist in sysfs.  Returns
+    the number of cpus found. */
+
+    char    name[64];
+    FILE*   file;
+    long    lo, hi, c;
+    int     n, sep;
+    size_t  bits;
+
+    bits = 8*sizeof(unsigned long);
+    memset(cpus, 0, ND_MAX_CPUS/8);
+    sprintf(name, "/sys/devices/system/node/node%d/cpulist", node);
+    file = fopen(name, "r");
+    if (file == NULL)
+        return 0;
+    n = 0;
+    while (fscanf(file, "%ld", &lo) == 1) {
+        hi = lo;
+        sep = fgetc(file);
+        if (sep == '-') {
+            if (fscanf(file, "%ld", &hi) != 1)
+                break;
+            sep = fgetc(file);
+        }
+        for (c = (lo > 0) ? lo : 0; c <= hi && c < ND_MAX_CPUS; c++) {
+            cpus[c/bits] |= 1UL << (c%bits);
+            n++;
+        }
+        if (sep != ',')
+            break;
+    }
+    fclose(file);
+    return n;
+}
+
+#endif
+
+/***************************************************************************/
+
+static 
+void nd_internal_numa_policy(void* base, size_t length, 
+                             struct nd_internal_touch_job* job, int njobs, 
+                             int policy)
+{
+ /* Apply the NUMA 'policy' to the mapped memory at 'base' of 'length'
+    bytes, before it is touched by the jobs, and for first touch and
+    binding, pin each job to the cpus of the node of its part.  Errors
+    are ignored, so that nothing happens on systems without NUMA
+    support or with a single node. */
+
+#ifdef ND_HAVE_NUMA
+    unsigned long  mask[ND_MAX_NUMA_NODES/(8*sizeof(unsigned long))];
+    unsigned long  nodemask[ND_MAX_NUMA_NODES/(8*sizeof(unsigned long))];
+    int            node[ND_MAX_NUMA_NODES];
+    int            nnodes, i, t, n;
+    size_t         bits, page, lo, hi;
+
+    for (t = 0; t < njobs; t++)
+        job[t].pinned = 0;
+    bits = 8*sizeof(unsigned long);
+    memset(mask, 0, sizeof(mask));
+    if (syscall(SYS_get_mempolicy, NULL, mask, (unsigned long)ND_MAX_NUMA_NODES,
+                NULL, (unsigned long)ND_MPOL_F_MEMS_ALLOWED) != 0)
+        return;
+    nnodes = 0;
+    for (i = 0; i < ND_MAX_NUMA_NODES; i++)
+        if (mask[i/bits] & (1UL << (i%bits)))
+            node[nnodes++] = i;
+    if (nnodes < 2)
+        return;
+    if (policy == ND_NUMA_INTERLEAVE) {
+        (void)syscall(SYS_mbind, base, (unsigned long)length, 
+                      (unsigned long)ND_MPOL_INTERLEAVE, mask, 
+                      (unsigned long)ND_MAX_NUMA_NODES, 0UL);
+        return;
+    }
+
+    /* part t goes to node t*nnodes/njobs, where thread t of a loop
+       runs if OMP_PROC_BIND=close or spread places the threads on all
+       nodes in order, and is touched from the cpus of that node */
+    for (t = 0; t < njobs; t++)
+        job[t].pinned = 
+            nd_internal_node_cpus(node[(long)t*nnodes/njobs], job[t].cpus) > 0;
+    if (policy == ND_NUMA_BIND) {
+        page = (size_t)sysconf(_SC_PAGESIZE);
+        /* the header and pointers stay on the nodes that are used, on
+           the pages that the pinned jobs fill */
+        hi = ((size_t)job[0].data + page - 1)/page*page;
+        if (hi > (size_t)base)
+            (void)syscall(SYS_mbind, base, (unsigned long)(hi - (size_t)base),
+                          (unsigned long)ND_MPOL_BIND, mask,
+                          (unsigned long)ND_MAX_NUMA_NODES, 0UL);
+        /* bind the data of consecutive jobs to consecutive nodes */
+        for (t = 0; t < njobs; t++) {
+            n = node[(long)t*nnodes/njobs];
+            lo = ((size_t)(job[t].data + job[t].lo*job[t].rowbytes) + page - 1)
+                 /page*page;
+            hi = ((size_t)(job[t].data + job[t].hi*job[t].rowbytes) + page - 1)
+                 /page*page;
+            if (t == njobs - 1)
+                hi = (size_t)base + length;
+            if (hi > lo) {
+                memset(nodemask, 0, sizeof(nodemask));
+                nodemask[n/bits] |= 1UL << (n%bits);
+                (void)syscall(SYS_mbind, (void*)lo, (unsigned long)(hi - lo),
+                              (unsigned long)ND_MPOL_BIND, nodemask,
+                              (unsigned long)ND_MAX_NUMA_NODES, 0UL);
+            }
+        }
+    }
+#else
+    (void)base;
+    (void)length;
+    (void)job;
+    (void)njobs;
+    (void)policy;
+#endif
+}
+
+#endif
+
+/***************************************************************************/
+
+/***************************************************************************/
+
+/*
+ * IMPLEMENTATION OF THE INTERFACE
+ */
+
+/***************************************************************************/
+
+void* sndmalloc(size_t size, short rank, const size_t* shape)
+{
+ /* Create a dynamically allocated multi- dimensional array of
+    dimensions n[0] x n[1] ... x n['rank'-1], with elements of 'size'
+    bytes.  The dimensions are given as the variable-length arguments.
+    The function allocates 'size'*n[0]*n[1]*..n['rank'-1] bytes for
+    the data, plus another n[0]*n[1]*...n[rank-2] *sizeof(void*) bytes
+    for the pointer-to-pointer structure that is common for c-style
+    arrays.  It also allocates internal buffers of moderate size.  The
+    pointer-to-pointer structure assumes that all pointers are the
+    same size.  The return value can be cast to a TYPE* for an array
+    of rank 1, TYPE** for rank 2, T*** for rank 3, etc.  .This casted
+    pointer can then be used in the same way a c-style array is used,
+    i.e., with repeated square bracket indexing.  If the memory
+    allocation fails, a NULL pointer is returned.  The return value
+    (or its casted version) can be used in calls to 'ndrealloc',
+    'ndfree', 'ndsize', 'nddata', 'ndrank', 'ndshape', 'ndisknown'.
+    This works because an internal header containing the information
+    about the multi-dimensional structure is associated with each
+    dynamicaly allocated multi-dimensional array. */
+
+    return nd_internal_malloc(size, rank, shape, 0, 0, 0);
+}
+
+/***************************************************************************/
+
+void* ndmalloc(size_t size, short rank, ...)
+{
+ /* Variadic version of sndmalloc */
+
+    void*    result;
+    size_t*  shape;
+    size_t   buf[small_rank+1];
+    va_list  arglist;
+
+    va_start(arglist, rank);
+    shape = nd_internal_create_shape(rank, arglist, buf);
+    va_end(arglist);
+    result = sndmalloc(size, rank, shape); /* calls non-variadic function */
+    nd_internal_destroy_va_shape(shape, buf);
+
+    return result;
+}
+
+/***************************************************************************/
+
+void* sndcalloc(size_t size, short rank, const size_t* shape)
+{
+ /* Same functionality as ndmalloc, but also initialized the array to
+    all zeros by calling 'calloc'. */
+
+    return nd_internal_malloc(size, rank, shape, 0, 0, 1);
+}
+
+/***************************************************************************/
+
+void* ndcalloc(size_t size, short rank, ...)
+{
+ /* Variadic version of sndcalloc */
+
+    void*    result;
+    size_t*  shape;
+    size_t   buf[small_rank+1];
+    va_list  arglist;
+
+    va_start(arglist, rank);
+    shape = nd_internal_create_shape(rank, arglist, buf);
+    va_end(arglist);
+    result = sndcalloc(size, rank, shape); /* calls non-variadic function */
+    nd_internal_destroy_va_shape(shape, buf);
+
+    return result;
+}
+
+/***************************************************************************/
+
+static 
+size_t nd_internal_check_align(size_t align)
+{
+ /* Return the alignment to use for a requested alignment 'align', or
+    zero if 'align' is not a power of two. */
+
+    if (align == 0 || (align & (align - 1)) != 0)
+        return 0;
+    if (align < mem_align_bytes)
+        align = mem_align_bytes;
+    return align;
+}
+
+/***************************************************************************/
+
+void* sndmalloc_aligned(size_t size, size_t align, short rank, 
+                        const size_t* shape)
+{
+ /* Same functionality as sndmalloc, but the data starts at an address
+    that is a multiple of 'align' bytes, which must be a power of
+    two. */
+
+    align = nd_internal_check_align(align);
+    if (align == 0)
+        return NULL;
+    return nd_internal_malloc(size, rank, shape, align, 0, 0);
+}
+
+/***************************************************************************/
+
+void* ndmalloc_aligned(size_t size, size_t align, short rank, ...)
+{
+ /* Variadic version of sndmalloc_aligned */
+
+    void*    result;
+    size_t*  shape;
+    size_t   buf[small_rank+1];
+    va_list  arglist;
+
+    va_start(arglist, rank);
+    shape = nd_internal_create_shape(rank, arglist, buf);
+    va_end(arglist);
+    result = sndmalloc_aligned(size, align, rank, shape);
+    nd_internal_destroy_va_shape(shape, buf);
+
+    return result;
+}
+
+/***************************************************************************/
+
+void* sndcalloc_aligned(size_t size, size_t align, short rank, 
+                        const size_t* shape)
+{
+ /* Same functionality as sndmalloc_aligned, but also initializes the
+    array to all zeros. */
+
+    align = nd_internal_check_align(align);
+    if (align == 0)
+        return NULL;
+    return nd_internal_malloc(size, rank, shape, align, 0, 1);
+}
+
+/***************************************************************************/
+
+void* ndcalloc_aligned(size_t size, size_t align, short rank, ...)
+{
+ /* Variadic version of sndcalloc_aligned */
+
+    void*    result;
+    size_t*  shape;
+    size_t   buf[small_rank+1];
+    va_list  arglist;
+
+    va_start(arglist, rank);
+    shape = nd_internal_create_shape(rank, arglist, buf);
+    va_end(arglist);
+    result = sndcalloc_aligned(size, align, rank, shape);
+    nd_internal_destroy_va_shape(shape, buf);
+
+    return result;
+}
+
+/***************************************************************************/
+
+void* sndmalloc_pitched(size_t size, size_t pitch, short rank, 
+                        const size_t* shape)
+{
+ /* Same functionality as sndmalloc, but with rows of the last
+    dimension 'pitch' elements apart in memory, or an automatically
+    chosen pitch if 'pitch' is zero. The data is aligned to a cache
+    line. */
+
+    if (shape == NULL)
+        return NULL;
+    if (rank > 1) {
+        if (pitch == 0)
+            pitch = nd_internal_auto_pitch(size, shape[rank-1]);
+        else if (pitch < shape[rank-1])
+            return NULL;
+    }
+    return nd_internal_malloc(size, rank, shape, cache_line_bytes, pitch, 0);
+}
+
+/***************************************************************************/
+
+void* ndmalloc_pitched(size_t size, size_t pitch, short rank, ...)
+{
+ /* Variadic version of sndmalloc_pitched */
+
+    void*    result;
+    size_t*  shape;
+    size_t   buf[small_rank+1];
+    va_list  arglist;
+
+    va_start(arglist, rank);
+    shape = nd_internal_create_shape(rank, arglist, buf);
+    va_end(arglist);
+    result = sndmalloc_pitched(size, pitch, rank, shape);
+    nd_internal_destroy_va_shape(shape, buf);
+
+    return result;
+}
+
+/***************************************************************************/
+
+void* sndcalloc_pitched(size_t size, size_t pitch, short rank, 
+                        const size_t* shape)
+{
+ /* Same functionality as sndmalloc_pitched, but also initializes the
+    array, including the padding, to all zeros. */
+
+    if (shape == NULL)
+        return NULL;
+    if (rank > 1) {
+        if (pitch == 0)
+            pitch = nd_internal_auto_pitch(size, shape[rank-1]);
+        else if (pitch < shape[rank-1])
+            return NULL;
+    }
+    return nd_internal_malloc(size, rank, shape, cache_line_bytes, pitch, 1);
+}
+
+/***************************************************************************/
+
+void* ndcalloc_pitched(size_t size, size_t pitch, short rank, ...)
+{
+ /* Variadic version of sndcalloc_pitched */
+
+    void*    result;
+    size_t*  shape;
+    size_t   buf[small_rank+1];
+    va_list  arglist;
+
+    va_start(arglist, rank);
+    shape = nd_internal_create_shape(rank, arglist, buf);
+    va_end(arglist);
+    result = sndcalloc_pitched(size, pitch, rank, shape);
+    nd_internal_destroy_va_shape(shape, buf);
+
+    return result;
+}
+
+/***************************************************************************/
+
+static 
+void* nd_internal_malloc_depth(size_t size, short depth, short rank, 
+                               const size_t* shape, int clear)
+{
+ /* Common implementation of sndmalloc_depth and sndcalloc_depth.  The
+    pointer table is that of an array of rank 'depth'+1 whose last
+    dimension spans the trailing dimensions of 'shape' together. */
+
+    size_t      buf[small_rank+1];
+    size_t*     effshape;
+    size_t*     shapecopy;
+    void*       array;
+    void*       data;
+    short       i;
+    ndreg_int   clue = NDREG_NOCLUE;
+
+    if (shape == NULL || depth < 1 || rank < 2)
+        return NULL;
+    if (depth >= rank-1)
+        return nd_internal_malloc(size, rank, shape, 0, 0, clear);
+
+    /* the shape of the table is on the stack unless the depth is large */
+    if (depth < small_rank)
+        effshape = buf;
+    else
+        effshape = malloc(sizeof(size_t)*(depth+2));
+    if (effshape == NULL)
+        return NULL;
+    for (i = 0; i < depth; i++)
+        effshape[i] = shape[i];
+    effshape[depth] = 1;
+    for (i = depth; i < rank; i++)
+        effshape[depth] *= shape[i];
+    nd_internal_set_shape(depth+1, effshape, effshape);
+
+    shapecopy = nd_internal_copy_shape(rank, shape);
+    data = NULL;
+    array = NULL;
+    if (shapecopy != NULL) {
+        if (clear)
+            data = nd_internal_create_clear_data(shapecopy[rank], size);
+        else
+            data = nd_internal_create_data(shapecopy[rank], size);
+    }
+    if (data != NULL)
+        array = nd_internal_create_array(data, size, depth+1, effshape, 
+                                         effshape[depth], &clue);
+    if (effshape != buf)
+        free(effshape);
+    if (array == NULL) {
+        if (shapecopy != NULL)
+            nd_internal_destroy_shape(shapecopy, 
+                                      nd_internal_shape_allocator(rank));
+        nd_internal_destroy_data(data);
+        return NULL;
+    }
+    nd_internal_create_header(array, rank, shapecopy, size, magic_mark, 
+                              partial_flag, clue);
+    nd_internal_get_header_address(array)->depth = depth;
+    nd_internal_get_header_address(array)->pitch = shapecopy[rank-1];
+    nd_internal_seal_header(array);
+    if (ndreg_add(data, &clue) != NDREG_SUCCESS) {
+        nd_internal_destroy_array(array, 
+                                  nd_internal_get_header_address(array)->clue);
+        nd_internal_destroy_shape(shapecopy, 
+                                  nd_internal_shape_allocator(rank));
+        nd_internal_destroy_data(data);
+        return NULL;
+    }
+    nd_internal_create_header(data, 1, shapecopy+rank, size, view_magic_mark, 
+                              partial_flag, clue);
+
+    return array;
+}
+
+/***************************************************************************/
+
+void* sndmalloc_depth(size_t size, short depth, short rank, 
+                      const size_t* shape)
+{
+ /* Same functionality as sndmalloc, but with only 'depth' levels of
+    pointers, the last of which points to contiguous blocks holding
+    the trailing rank-'depth' dimensions. */
+
+    return nd_internal_malloc_depth(size, depth, rank, shape, 0);
+}
+
+/***************************************************************************/
+
+void* ndmalloc_depth(size_t size, short depth, short rank, ...)
+{
+ /* Variadic version of sndmalloc_depth */
+
+    void*    result;
+    size_t*  shape;
+    size_t   buf[small_rank+1];
+    va_list  arglist;
+
+    va_start(arglist, rank);
+    shape = nd_internal_create_shape(rank, arglist, buf);
+    va_end(arglist);
+    result = sndmalloc_depth(size, depth, rank, shape);
+    nd_internal_destroy_va_shape(shape, buf);
+
+    return result;
+}
+
+/***************************************************************************/
+
+void* sndcalloc_depth(size_t size, short depth, short rank, 
+                      const size_t* shape)
+{
+ /* Same functionality as sndmalloc_depth, but the array is
+    zero-initialized. */
+
+    return nd_internal_malloc_depth(size, depth, rank, shape, 1);
+}
+
+/***************************************************************************/
+
+void* ndcalloc_depth(size_t size, short depth, short rank, ...)
+{
+ /* Variadic version of sndcalloc_depth */
+
+    void*    result;
+    size_t*  shape;
+    size_t   buf[small_rank+1];
+    va_list  arglist;
+
+    va_start(arglist, rank);
+    shape = nd_internal_create_shape(rank, arglist, buf);
+    va_end(arglist);
+    result = sndcalloc_depth(size, depth, rank, shape);
+    nd_internal_destroy_va_shape(shape, buf);
+
+    return result;
+}
+
+/***************************************************************************/
+
+void* sndcalloc_parallel(size_t size, int nthreads, int policy, 
+                         short rank, const size_t* shape)
+{
+ /* Same functionality as sndcalloc, but the memory is zeroed by
+    'nthreads' threads, each touching a contiguous part of the rows of
+    the first dimension, as an OpenMP loop with a static schedule
+    would divide them. The memory is placed according to 'policy'. */
+
+#ifdef ND_HAVE_MMAP
+    void*                          array;
+    char*                          data;
+    struct header*                 hdr;
+    struct nd_internal_touch_job   onejob;
+    struct nd_internal_touch_job*  job;
+    pthread_t*                     thread;
+    int*                           started;
+    size_t                         n0, q, r;
+    int                            t;
+#endif
+
+    if (shape == NULL)
+        return NULL;
+    if (policy != ND_NUMA_FIRSTTOUCH && policy != ND_NUMA_INTERLEAVE
+        && policy != ND_NUMA_BIND)
+        return NULL;
+
+#ifdef ND_HAVE_MMAP
+
+    array = nd_internal_create_block(size, rank, shape, 0, 0, alloc_untouched);
+    if (array == NULL)
+        return NULL;
+    hdr = nd_internal_get_header_address(array);
+    /* the pointers are not filled yet, but the data follows them */
+    data = (char*)array;
+    if (rank > 1)
+        data += nd_internal_table_length(rank, hdr->shape)*sizeof(char*) 
+                + header_size;
+
+    if (nthreads <= 0)
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    n0 = hdr->shape[0];
+    if ((size_t)nthreads > n0)
+        nthreads = (int)n0;
+    if (nthreads < 1)
+        nthreads = 1;
+    job = NULL;
+    thread = NULL;
+    started = NULL;
+    if (nthreads > 1) {
+        job     = malloc(nthreads*sizeof(struct nd_internal_touch_job));
+        thread  = malloc(nthreads*sizeof(pthread_t));
+        started = calloc(nthreads, sizeof(int));
+    }
+    if (job == NULL || thread == NULL || started == NULL) {
+        free(job);
+        free(thread);
+        free(started);
+        job = &onejob;
+        thread = NULL;
+        started = NULL;
+        nthreads = 1;
+    }
+
+    /* same partition as the static schedule of libgomp */
+    q = n0/nthreads;
+    r = n0%nthreads;
+    for (t = 0; t < nthreads; t++) {
+        job[t].table    = (char**)array;
+        job[t].data     = data;
+        job[t].size     = size;
+        job[t].rank     = rank;
+        job[t].shape    = hdr->shape;
+        job[t].rowbytes = n0 ? nd_internal_fullsize_shape(rank, hdr->shape)/n0*size : 0;
+        job[t].lo       = ((size_t)t < r) ? t*(q+1) : t*q + r;
+        job[t].hi       = job[t].lo + (((size_t)t < r) ? q+1 : q);
+    }
+    nd_internal_numa_policy(hdr->base, hdr->maplength, job, nthreads, policy);
+
+    /* every part gets its own thread, so that the calling thread stays
+       where it is; parts whose thread can not be started are done by
+       the calling thread, without pinning it */
+    if (nthreads == 1) {
+#ifdef ND_HAVE_NUMA
+        job[0].pinned = 0;
+#endif
+        (void)nd_internal_touch_rows(&job[0]);
+    } else {
+        for (t = 0; t < nthreads; t++)
+            started[t] = (pthread_create(&thread[t], NULL, 
+                                         nd_internal_touch_rows, &job[t]) == 0);
+        for (t = 0; t < nthreads; t++)
+            if (! started[t]) {
+#ifdef ND_HAVE_NUMA
+                job[t].pinned = 0;
+#endif
+                (void)nd_internal_touch_rows(&job[t]);
+            }
+        for (t = 0; t < nthreads; t++)
+            if (started[t])
+                (void)pthread_join(thread[t], NULL);
+    }
+
+    if (job != &onejob) {
+        free(job);
+        free(thread);
+        free(started);
+    }
+    return array;
+#else
+    (void)nthreads;
+    return sndcalloc(size, rank, shape);
+#endif
+}
+
+/***************************************************************************/
+
+void* ndcalloc_parallel(size_t size, int nthreads, int policy, short rank, ...)
+{
+ /* Variadic version of sndcalloc_parallel */
+
+    void*    result;
+    size_t*  shape;
+    size_t   buf[small_rank+1];
+    va_list  arglist;
+
+    va_start(arglist, rank);
+    shape = nd_internal_create_shape(rank, arglist, buf);
+    va_end(arglist);
+    result = sndcalloc_parallel(size, nthreads, policy, rank, shape);
+    nd_internal_destroy_va_shape(shape, buf);
+
+    return result;
+}
+
+/***************************************************************************/
+
+static 
+struct nd_internal_chunk* nd_internal_create_chunk(size_t bytes)
+{
+ /* Allocate a chunk for an arena with room for 'bytes' bytes. */
+
+    struct nd_internal_chunk*  chunk;
+    size_t                     maplength;
+    const ndallocator_t*       allocator;
+
+    bytes += sizeof(struct nd_internal_chunk);
+    chunk = nd_internal_alloc_memory(bytes, alloc_uninit, ND_ALLOC_DATA,
+                                     &maplength, &allocator);
+    if (chunk != NULL) {
+        chunk->next = NULL;
+        chunk->end = (char*)chunk + bytes;
+        chunk->maplength = maplength;
+        chunk->allocator = allocator;
+    }
+    return chunk;
+}
+
+/***************************************************************************/
+
+ndarena_t* ndarena_create(size_t bytes)
+{
+ /* Create an arena with room for about 'bytes' bytes of nd arrays. */
+
+    ndarena_t* arena;
+
+    arena = malloc(sizeof(ndarena_t));
+    if (arena == NULL)
+        return NULL;
+    arena->first = nd_internal_create_chunk(bytes);
+    if (arena->first == NULL) {
+        free(arena);
+        return NULL;
+    }
+    arena->current = arena->first;
+    arena->next = (char*)(arena->first + 1);
+    return arena;
+}
+
+/***************************************************************************/
+
+void* sndarena_malloc(ndarena_t* arena, size_t size, short rank, 
+                      const size_t* shape)
+{
+ /* Same functionality as sndmalloc, but the array is placed in the
+    arena 'arena', as a single block that is not registered. */
+
+    struct nd_internal_chunk*  chunk;
+    size_t                     ntable, offset, total;
+    char*                      block;
+    char*                      data;
+    void*                      array;
+
+    if (arena == NULL || shape == NULL)
+        return NULL;
+
+    offset = nd_internal_block_offset(rank, shape, &ntable);
+    total = offset + block_align_bytes - 1 
+            + nd_internal_memsize_shape(rank, shape, 0)*size;
+    if ((size_t)(arena->current->end - arena->next) < total) {
+        /* reuse the next chunk kept by ndarena_reset if it is large
+           enough, or else add one at least as large as the first one */
+        chunk = arena->current->next;
+        if (chunk == NULL || (size_t)(chunk->end - (char*)(chunk + 1)) < total) {
+            if ((size_t)(arena->first->end - (char*)(arena->first + 1)) > total)
+                chunk = nd_internal_create_chunk(arena->first->end 
+                                                 - (char*)(arena->first + 1));
+            else
+                chunk = nd_internal_create_chunk(total);
+            if (chunk == NULL)
+                return NULL;
+            chunk->next = arena->current->next;
+            arena->current->next = chunk;
+        }
+        arena->current = chunk;
+        arena->next = (char*)(chunk + 1);
+    }
+
+    block = arena->next;
+    data = (char*)(((size_t)(block + offset) + block_align_bytes - 1) 
+                   & ~(block_align_bytes - 1));
+    arena->next = data 
+        + (nd_internal_memsize_shape(rank, shape, 0)*size + mem_align_bytes - 1)
+          /mem_align_bytes*mem_align_bytes;
+
+    array = nd_internal_place_block(block, data, size, rank, shape, ntable,
+                                    block_align_bytes, 0, arena_flag, 1);
+    /* arena arrays are not known arrays, also without a registry */
+    nd_internal_clear_header(array);
+    if (rank > 1)
+        nd_internal_clear_header(data);
+    return array;
+}
+
+/***************************************************************************/
+
+void* ndarena_malloc(ndarena_t* arena, size_t size, short rank, ...)
+{
+ /* Variadic version of sndarena_malloc */
+
+    void*    result;
+    size_t*  shape;
+    size_t   buf[small_rank+1];
+    va_list  arglist;
+
+    va_start(arglist, rank);
+    shape = nd_internal_create_shape(rank, arglist, buf);
+    va_end(arglist);
+    result = sndarena_malloc(arena, size, rank, shape);
+    nd_internal_destroy_va_shape(shape, buf);
+
+    return result;
+}
+
+/***************************************************************************/
+
+void* sndarena_calloc(ndarena_t* arena, size_t size, short rank, 
+                      const size_t* shape)
+{
+ /* Same functionality as sndarena_malloc, but also initializes the
+    array to all zeros. */
+
+    void* array;
+
+    array = sndarena_malloc(arena, size, rank, shape);
+    if (array != NULL)
+        memset(nd_internal_get_data(array, rank), 0, ndfullsize(array)*size);
+    return array;
+}
+
+/***************************************************************************/
+
+void* ndarena_calloc(ndarena_t* arena, size_t size, short rank, ...)
+{
+ /* Variadic version of sndarena_calloc */
+
+    void*    result;
+    size_t*  shape;
+    size_t   buf[small_rank+1];
+    va_list  arglist;
+
+    va_start(arglist, rank);
+    shape = nd_internal_create_shape(rank, arglist, buf);
+    va_end(arglist);
+    result = sndarena_calloc(arena, size, rank, shape);
+    nd_internal_destroy_va_shape(shape, buf);
+
+    return result;
+}
+
+/***************************************************************************/
+
+void ndarena_reset(ndarena_t* arena)
+{
+ /* Release all arrays in the arena at once, keeping its chunks to be
+    filled again. */
+
+    if (arena == NULL)
+        return;
+    arena->current = arena->first;
+    arena->next = (char*)(arena->first + 1);
+}
+
+/***************************************************************************/
+
+void ndarena_destroy(ndarena_t* arena)
+{
+ /* Release all arrays in the arena and the arena itself. */
+
+    struct nd_internal_chunk* chunk;
+
+    if (arena == NULL)
+        return;
+    while (arena->first != NULL) {
+        chunk = arena->first;
+        arena->first = chunk->next;
+        nd_internal_free_memory(chunk, chunk->maplength, chunk->allocator);
+    }
+    free(arena);
+}
+
+/***************************************************************************/
+
+static 
+int nd_internal_malloc_batch(size_t size, size_t count, void** arrays, 
+                             short rank, const size_t* shape, int clear)
+{
+ /* Common implementation of sndmalloc_batch and sndcalloc_batch: one
+    block of memory holds the 'count' arrays, each laid out as a
+    single block, with the pointer table of the first array copied
+    and rebased for the others. All arrays are registered at once. */
+
+    size_t                ntable, offset, stride, total, maplength;
+    size_t                nkeys, delta, j, k;
+    char*                 base;
+    char*                 block;
+    char*                 data;
+    char**                table;
+    struct header*        hdr;
+    ndreg_ptr_t*          keys;
+    ndreg_int*            clues;
+    const ndallocator_t*  allocator;
+
+    if (shape == NULL || arrays == NULL || count == 0)
+        return 0;
+
+    offset = nd_internal_block_offset(rank, shape, &ntable);
+    offset = (offset + block_align_bytes - 1)/block_align_bytes
+             *block_align_bytes;
+    stride = (offset + nd_internal_memsize_shape(rank, shape, 0)*size
+              + block_align_bytes - 1)/block_align_bytes*block_align_bytes;
+    total = batch_header_size + count*stride;
+    nkeys = (rank > 1) ? 2*count : count;
+
+    keys = malloc(nkeys*(sizeof(ndreg_ptr_t) + sizeof(ndreg_int)));
+    if (keys == NULL)
+        return 0;
+    clues = (ndreg_int*)(keys + nkeys);
+    base = nd_internal_alloc_memory(total, clear, ND_ALLOC_DATA, 
+                                    &maplength, &allocator);
+    if (base == NULL) {
+        free(keys);
+        return 0;
+    }
+    ((struct nd_internal_batch*)base)->live = count;
+
+    for (k = 0; k < count; k++) {
+        block = base + batch_header_size + k*stride;
+        data = block + offset;
+        arrays[k] = nd_internal_place_block(block, data, size, rank, shape,
+                                            ntable, block_align_bytes, 0,
+                                            single_block_flag|batch_flag,
+                                            k == 0);
+        if (k > 0 && rank > 1) {
+            /* all pointers in the table point into the same block */
+            table = (char**)arrays[k];
+            delta = k*stride;
+            for (j = 0; j < ntable; j++)
+                table[j] = ((char**)arrays[0])[j] + delta;
+        }
+        hdr = nd_internal_get_header_address(arrays[k]);
+        hdr->base      = base;
+        hdr->maplength = maplength;
+        hdr->allocator = allocator;
+        keys[k] = arrays[k];
+        if (rank > 1) {
+            hdr = nd_internal_get_header_address(data);
+            hdr->base      = base;
+            hdr->maplength = maplength;
+            hdr->allocator = allocator;
+            keys[count + k] = data;
+        }
+    }
+
+    if (ndreg_add_many(keys, (ndreg_int)nkeys, clues) != NDREG_SUCCESS) {
+        nd_internal_free_memory(base, maplength, allocator);
+        free(keys);
+        for (k = 0; k < count; k++)
+            arrays[k] = NULL;
+        return 0;
+    }
+    for (j = 0; j < nkeys; j++)
+        nd_internal_get_header_address(keys[j])->clue = clues[j];
+    free(keys);
+
+    return 1;
+}
+
+/***************************************************************************/
+
+int sndmalloc_batch(size_t size, size_t count, void** arrays, 
+                    short rank, const size_t* shape)
+{
+ /* Allocate 'count' arrays with the same functionality as sndmalloc
+    in a single block of memory, and store them in 'arrays'.  Returns
+    1 on success and 0 on failure. */
+
+    return nd_internal_malloc_batch(size, count, arrays, rank, shape, 0);
+}
+
+/***************************************************************************/
+
+int ndmalloc_batch(size_t size, size_t count, void** arrays, short rank, ...)
+{
+ /* Variadic version of sndmalloc_batch */
+
+    int      result;
+    size_t*  shape;
+    size_t   buf[small_rank+1];
+    va_list  arglist;
+
+    va_start(arglist, rank);
+    shape = nd_internal_create_shape(rank, arglist, buf);
+    va_end(arglist);
+    result = sndmalloc_batch(size, count, arrays, rank, shape);
+    nd_internal_destroy_va_shape(shape, buf);
+
+    return result;
+}
+
+/***************************************************************************/
+
+int sndcalloc_batch(size_t size, size_t count, void** arrays, 
+                    short rank, const size_t* shape)
+{
+ /* Same as sndmalloc_batch, but the arrays are zero-initialized. */
+
+    return nd_internal_malloc_batch(size, count, arrays, rank, shape, 1);
+}
+
+/***************************************************************************/
+
+int ndcalloc_batch(size_t size, size_t count, void** arrays, short rank, ...)
+{
+ /* Variadic version of sndcalloc_batch */
+
+    int      result;
+    size_t*  shape;
+    size_t   buf[small_rank+1];
+    va_list  arglist;
+
+    va_start(arglist, rank);
+    shape = nd_internal_create_shape(rank, arglist, buf);
+    va_end(arglist);
+    result = sndcalloc_batch(size, count, arrays, rank, shape);
+    nd_internal_destroy_va_shape(shape, buf);
+
+    return result;
+}
+
+/***************************************************************************/
+
+void ndfree_batch(void** arrays, size_t count)
+{
+ /* Free the 'count' arrays in 'arrays'.  If they are all the arrays
+    left of one batch, they are unregistered at once and their memory
+    is released in one go; otherwise they are freed one by one. */
+
+    struct header*  hdr;
+    void*           base;
+    ndreg_ptr_t*    keys;
+    size_t          k, nkeys;
+    short           rank;
+
+    if (count == 0 || arrays == NULL)
+        return;
+    base = NULL;
+    rank = 0;
+    for (k = 0; k < count; k++) {
+        if (! ndisknown(arrays[k]))
+            break;
+        hdr = nd_internal_get_header_address(arrays[k]);
+        if (! (hdr->flags & batch_flag) || (hdr->magic & 1) == 1
+            || (k > 0 && (hdr->base != base || hdr->rank != rank)))
+            break;
+        base = hdr->base;
+        rank = hdr->rank;
+    }
+    nkeys = (rank > 1) ? 2*count : count;
+    keys = NULL;
+    if (k == count && ! deferred_free_mode
+        && ((struct nd_internal_batch*)base)->live == count)
+        keys = malloc(nkeys*sizeof(ndreg_ptr_t));
+    if (keys == NULL) {
+        for (k = 0; k < count; k++)
+            ndfree(arrays[k]);
+        return;
+    }
+    for (k = 0; k < count; k++) {
+        keys[k] = arrays[k];
+        if (rank > 1)
+            keys[count + k] = nd_internal_get_data(arrays[k], rank);
+    }
+    (void)ndreg_remove_many(keys, (ndreg_int)nkeys, NULL);
+    for (k = 0; k < nkeys; k++)
+        nd_internal_clear_header((void*)keys[k]);
+    free(keys);
+    hdr = nd_internal_get_header_address(arrays[0]);
+    nd_internal_free_memory(base, hdr->maplength, hdr->allocator);
+}
+
+/***************************************************************************/
+
+static 
+int nd_internal_is_arena_array(const void* ptr)
+{
+ /* Check whether 'ptr', which is not a known array, is an array or
+    the data of an array in an arena, which belongs to the arena and
+    is released with it. */
+
+    struct header* hdr;
+
+    hdr = nd_internal_get_header_address(ptr);
+    return hdr != NULL 
+        && (hdr->magic | 1) == (magic_mark | 1)
+        && (hdr->flags & arena_flag) != 0;
+}
+
+/***************************************************************************/
+
+int ndisknown(const void* ptr)
+{
+ /* Check if 'ptr's is an array allocated with (s)ndmalloc,
+    (s)ndcalloc, (s)ndrealloc, or (s)ndview. */
+
+    struct header* hdr;
+
+    hdr = nd_internal_get_header_address(ptr);
+
+    return hdr != NULL 
+        && (hdr->magic | 1) == (magic_mark | 1)
+        && nd_internal_check_header(ptr, hdr);
+}
+
+/***************************************************************************/
+
+struct nd_internal_move_job {
+
+ /* Rows of an nd array to be moved to their place in a resized array
+    by one thread in nd_internal_move_rows.  Kept rows are the rows
+    with a multi-index inside both the old and the new dimensions,
+    counted in row-major order. */
+
+    const char*    src;       /* start of the old data              */
+    char*          dst;       /* start of the new data              */
+    size_t         srcpitch;  /* bytes between old rows             */
+    size_t         dstpitch;  /* bytes between new rows             */
+    size_t         rowbytes;  /* bytes kept of each row             */
+    size_t         end;       /* bytes of the new data              */
+    short          rank;      /* number of dimensions               */
+    const size_t*  from;      /* old dimensions                     */
+    const size_t*  to;        /* new dimensions                     */
+    int            backwards; /* growing in place, zeroing the rest */
+    size_t         nkept;     /* number of kept rows                */
+    size_t         lo, hi;    /* kept rows to move                  */
+};
+
+/* Rows are moved by several threads at once if there are at least
+   parallel_move_bytes to move, using at most move_threads threads. */
+
+#define parallel_move_bytes (16*1024*1024)
+#define move_threads        64
+
+/***************************************************************************/
+
+static 
+size_t nd_internal_row_index(const struct nd_internal_move_job* job, 
+                             size_t k, const size_t* shape)
+{
+ /* Index of the row in an array of dimensions 'shape' that has the
+    same multi-index as kept row 'k' of 'job'. */
+
+    size_t  index, stride, kept;
+    short   i;
+
+    index = 0;
+    stride = 1;
+    for (i = job->rank-2; i >= 0; i--) {
+        kept = (job->from[i] < job->to[i]) ? job->from[i] : job->to[i];
+        index += (k % kept)*stride;
+        k /= kept;
+        stride *= shape[i];
+    }
+    return index;
+}
+
+/***************************************************************************/
+
+static 
+void* nd_internal_move_rows(void* arg)
+{
+ /* Move kept rows job->lo to job->hi-1 to their new place.  When
+    growing in place, this goes backwards, and the new elements up to
+    the next kept row are zeroed. */
+
+    struct nd_internal_move_job* job = (struct nd_internal_move_job*)arg;
+    char*   dst;
+    char*   next;
+    size_t  k;
+
+    if (job->backwards) {
+        for (k = job->hi; k-- > job->lo; ) {
+            dst = job->dst + nd_internal_row_index(job, k, job->to)*job->dstpitch;
+            memmove(dst, 
+                    job->src + nd_internal_row_index(job, k, job->from)*job->srcpitch,
+                    job->rowbytes);
+            if (k+1 < job->nkept)
+                next = job->dst + nd_internal_row_index(job, k+1, job->to)*job->dstpitch;
+            else
+                next = job->dst + job->end;
+            memset(dst + job->rowbytes, 0, next - dst - job->rowbytes);
+        }
+    } else {
+        for (k = job->lo; k < job->hi; k++)
+            memmove(job->dst + nd_internal_row_index(job, k, job->to)*job->dstpitch,
+                    job->src + nd_internal_row_index(job, k, job->from)*job->srcpitch,
+                    job->rowbytes);
+    }
+    return NULL;
+}
+
+/***************************************************************************/
+
+static 
+void nd_internal_run_moves(const struct nd_internal_move_job* all, 
+                           size_t lo, size_t hi)
+{
+ /* Move the kept rows 'lo' to 'hi'-1 of 'all', which must be
+    independent of each other, dividing them over threads if there
+    are enough bytes to move. */
+
+    struct nd_internal_move_job  job[move_threads];
+#ifdef ND_HAVE_MMAP
+    pthread_t                    thread[move_threads];
+    int                          started[move_threads];
+#endif
+    size_t                       q, r;
+    int                          nthreads, t;
+
+    nthreads = 1;
+#ifdef ND_HAVE_MMAP
+    if ((hi - lo)*all->rowbytes >= parallel_move_bytes) {
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (nthreads > move_threads)
+            nthreads = move_threads;
+        if ((size_t)nthreads > hi - lo)
+            nthreads = (int)(hi - lo);
+        if (nthreads < 1)
+            nthreads = 1;
+    }
+#endif
+    q = (hi - lo)/nthreads;
+    r = (hi - lo)%nthreads;
+    for (t = 0; t < nthreads; t++) {
+        job[t]    = *all;
+        job[t].lo = lo + (((size_t)t < r) ? t*(q+1) : t*q + r);
+        job[t].hi = job[t].lo + (((size_t)t < r) ? q+1 : q);
+    }
+#ifdef ND_HAVE_MMAP
+    /* threads that can not be started are done by the calling thread */
+    for (t = 1; t < nthreads; t++)
+        started[t] = (pthread_create(&thread[t], NULL, 
+                                     nd_internal_move_rows, &job[t]) == 0);
+    for (t = 0; t < nthreads; t++)
+        if (t == 0 || ! started[t])
+            (void)nd_internal_move_rows(&job[t]);
+    for (t = 1; t < nthreads; t++)
+        if (started[t])
+            (void)pthread_join(thread[t], NULL);
+#else
+    (void)nd_internal_move_rows(&job[0]);
+#endif
+}
+
+/***************************************************************************/
+
+static 
+void nd_internal_move_kept(const void* src, size_t srcpitch, 
+                           void* dst, size_t dstpitch, size_t size, 
+                           short rank, const size_t* from, const size_t* to,
+                           int grow, size_t end)
+{
+ /* Move the elements of the data 'src' of an array with dimensions
+    'from' to the same multi-index in the data 'dst' of an array with
+    dimensions 'to', with rows 'srcpitch' and 'dstpitch' bytes apart.
+    If 'src' and 'dst' are the same, all dimensions must either grow,
+    as indicated by 'grow', or shrink; when growing, the rest of the
+    'end' bytes of the new data is zeroed.  Rows are moved in blocks
+    whose new places do not overlap the old places of the rows in the
+    block, and the rows of a block are divided over threads.  If only
+    the first dimension changes, no row moves and none is touched. */
+
+    struct nd_internal_move_job  all;
+    size_t                       lo, hi, mid, limit;
+    short                        i;
+
+    all.src      = (const char*)src;
+    all.dst      = (char*)dst;
+    all.srcpitch = srcpitch;
+    all.dstpitch = dstpitch;
+    all.rowbytes = ((from[rank-1] < to[rank-1]) ? from[rank-1] : to[rank-1])*size;
+    all.end      = end;
+    all.rank     = rank;
+    all.from     = from;
+    all.to       = to;
+    all.backwards = (src == dst && grow);
+    all.nkept    = 1;
+    for (i = 0; i < rank-1; i++)
+        all.nkept *= (from[i] < to[i]) ? from[i] : to[i];
+
+    if (all.nkept == 0) {
+        if (all.backwards)
+            memset(dst, 0, end);
+        return;
+    }
+    if (src != dst) {
+        nd_internal_run_moves(&all, 0, all.nkept);
+        return;
+    }
+    /* when only the first dimension changes, and rows are not padded,
+       the kept rows are already in place, and only the new elements
+       after them are zeroed */
+    for (i = 1; i < rank-1 && from[i] == to[i]; i++)
+        ;
+    if (i >= rank-1 && srcpitch == dstpitch && dstpitch == all.rowbytes) {
+        if (all.backwards)
+            memset(all.dst + all.nkept*dstpitch, 0, end - all.nkept*dstpitch);
+        return;
+    }
+    if (all.backwards) {
+        /* from the end, rows lo..hi-1 can move together if their new
+           places lie after all of their old places */
+        for (hi = all.nkept; hi > 0; hi = lo) {
+            limit = nd_internal_row_index(&all, hi-1, from)*srcpitch + all.rowbytes;
+            lo = 0;
+            mid = hi-1;
+            while (lo < mid) {
+                if (nd_internal_row_index(&all, (lo+mid)/2, to)*dstpitch >= limit)
+                    mid = (lo+mid)/2;
+                else
+                    lo = (lo+mid)/2 + 1;
+            }
+            nd_internal_run_moves(&all, lo, hi);
+        }
+    } else {
+        /* from the start, rows lo..hi-1 can move together if their new
+           places lie before all of their old places */
+        for (lo = 0; lo < all.nkept; lo = hi) {
+            limit = nd_internal_row_index(&all, lo, from)*srcpitch;
+            hi = all.nkept;
+            mid = lo+1;
+            while (mid < hi) {
+                if (nd_internal_row_index(&all, (mid+hi+1)/2-1, to)*dstpitch
+                    + all.rowbytes <= limit)
+                    mid = (mid+hi+1)/2;
+                else
+                    hi = (mid+hi+1)/2 - 1;
+            }
+            hi = mid;
+            nd_internal_run_moves(&all, lo, hi);
+        }
+    }
+}
+
+/***************************************************************************/
+
+static 
+void nd_internal_rotate_pointers(char** p, size_t n, size_t shift)
+{
+ /* Rotate the 'n' pointers at 'p' so that p[i] becomes the old
+    p[(i+shift)%n], by three reversals. */
+
+    size_t  lo, hi, k;
+    char*   tmp;
+
+    for (k = 0; k < 3; k++) {
+        lo = (k == 1) ? shift : 0;
+        hi = (k == 0) ? shift : n;
+        while (lo + 1 < hi) {
+            tmp = p[lo];
+            p[lo++] = p[--hi];
+            p[hi] = tmp;
+        }
+    }
+}
+
+/***************************************************************************/
+
+static 
+void nd_internal_swap_bytes(char* a, char* b, size_t nbytes)
+{
+ /* Exchange 'nbytes' bytes at 'a' and 'b', which do not overlap. */
+
+    char    buf[256];
+    size_t  m;
+
+    while (nbytes > 0) {
+        m = (nbytes < sizeof(buf)) ? nbytes : sizeof(buf);
+        memcpy(buf, a, m);
+        memcpy(a, b, m);
+        memcpy(b, buf, m);
+        a += m;
+        b += m;
+        nbytes -= m;
+    }
+}
+
+/***************************************************************************/
+
+static 
+int nd_internal_compact(void* ptr)
+{
+ /* Write the data of the nd array 'ptr' back in the order of its
+    first-level pointers, which ndrotate or ndpermute_rows reordered,
+    and put the pointers back in memory order.  Returns 0 if no scratch
+    memory could be allocated, in which case 'ptr' is left intact. */
+
+    struct header*  hdr;
+    void**          rows;
+    void**          tmp;
+    size_t*         from;
+    char*           data;
+    size_t          n0, nfirst, slab, i, k, next;
+    short           j;
+
+    hdr = nd_internal_get_header_address(ptr);
+    rows = ptr;
+    n0 = hdr->shape[0];
+    data = nd_internal_get_data(ptr, hdr->depth+1);
+    /* the data of each index of the first dimension is a slab */
+    slab = ndpitch(ptr)*hdr->size;
+    for (j = 1; j < hdr->rank-1; j++)
+        slab *= hdr->shape[j];
+    if (n0 > 0 && slab > 0) {
+        from = malloc(n0*sizeof(size_t));
+        tmp  = malloc(n0*sizeof(void*));
+        if (from == NULL || tmp == NULL) {
+            free(from);
+            free(tmp);
+            return 0;
+        }
+
+        /* from[i] is the slab that holds the data of index i */
+        nfirst = (hdr->flags & reserved_flag) ? hdr->capacity : n0;
+        for (i = 0; i < n0; i++) {
+            if (hdr->depth == 1)
+                from[i] = ((char*)rows[i] - data)/slab;
+            else
+                from[i] = ((void**)rows[i] - (rows + nfirst))/hdr->shape[1];
+            tmp[from[i]] = rows[i];
+        }
+        memcpy(rows, tmp, n0*sizeof(void*));
+
+        /* follow each cycle, swapping every slab into the place of its
+           index */
+        for (i = 0; i < n0; i++) {
+            k = i;
+            while (from[k] != i) {
+                nd_internal_swap_bytes(data + k*slab, data + from[k]*slab, 
+                                       slab);
+                next = from[k];
+                from[k] = k;
+                k = next;
+            }
+            from[k] = k;
+        }
+        free(from);
+        free(tmp);
+    }
+    hdr->flags &= ~permuted_flag;
+    hdr->origin = 0;
+    nd_internal_seal_header(ptr);
+    return 1;
+}
+
+/***************************************************************************/
+
+static 
+void* nd_internal_realloc( void*          ptr, 
+                           size_t         size, 
+                           short          rank, 
+                           const size_t*  shape,
+                           int            resize )
+{
+ /* Common implementation of sndrealloc and sndresize.  If 'resize' is
+    nonzero, elements keep their multi-index instead of their
+    position in row-major order, new elements are zero, and 'rank'
+    and 'size' must be those of 'ptr'. */
+
+    void*           array;
+    void*           olddata;
+    void*           data;
+    char**          table;
+    size_t          total_elements;
+    size_t          nbytes;
+    size_t          pitch;
+    short           oldrank;
+    ndreg_int       oldclue;
+    ndreg_int       tableclue = NDREG_NOCLUE;
+    size_t*         oldshape;
+    size_t*         shapecopy;
+    struct header*  hdr;
+    const ndallocator_t* oldallocator;
+    int             reuse;
+    int             grow, shrink;
+    short           i;
+    ndreg_int       clue = NDREG_NOCLUE;
+    ndreg_int       dataclue = NDREG_NOCLUE;
+    
+    if (shape == NULL) 
+        return NULL;
+
+    hdr = nd_internal_get_header_address(ptr);
+
+    /* can only reshape ndmalloc arrays, not pointer, not views, and not
+       arrays in an arena */
+    if (hdr == NULL || nd_internal_is_arena_array(ptr) || ! ndisknown(ptr) 
+        || (hdr->magic&1) == 1 )
+      return NULL;
+
+    /* the data is used in memory order, which has to match the
+       indices again */
+    if ((hdr->flags & permuted_flag) && ! nd_internal_compact(ptr))
+        return NULL;
+
+    grow = 0;
+    shrink = 0;
+    if (resize) {
+        if (rank != hdr->rank || size != hdr->size)
+            return NULL;
+        grow = 1;
+        shrink = 1;
+        for (i = 0; i < rank; i++) {
+            if (shape[i] < hdr->shape[i])
+                grow = 0;
+            if (shape[i] > hdr->shape[i])
+                shrink = 0;
+        }
+        if (grow && shrink)
+            return ptr;
+    }
+
+    if (hdr->flags != 0 || (resize && ! grow && ! shrink)) {
+        /* single blocks, aligned and pitched data, partial tables and
+           arrays with reserved capacity are reallocated by copying
+           into a new array, which leaves 'ptr' intact if that fails.
+           A pitch is kept if the new rows fit, and so is the depth of
+           a partial table, but not the reserved capacity.  Resizes
+           that grow some dimensions and shrink others are copied
+           too. */
+        olddata = nd_internal_get_data(ptr, hdr->depth+1);
+        pitch = 0;
+        if ((hdr->flags & pitched_flag) && rank > 1) {
+            pitch = hdr->pitch;
+            if (pitch < shape[rank-1])
+                pitch = nd_internal_auto_pitch(size, shape[rank-1]);
+        }
+        if (hdr->flags & partial_flag)
+            array = nd_internal_malloc_depth(size, hdr->depth, rank, shape, 
+                                             resize);
+        else
+            array = nd_internal_malloc(size, rank, shape, 
+                  (hdr->flags & aligned_flag) 
+                  ? nd_internal_get_header_address(olddata)->align : 0, 
+                  pitch, resize);
+        if (array != NULL && resize) {
+            nd_internal_move_kept(olddata, ndpitch(ptr)*size, 
+                                  nddata(array), ndpitch(array)*size, size, 
+                                  rank, hdr->shape, shape, 0, 0);
+            ndfree(ptr);
+        } else if (array != NULL) {
+            nbytes = nd_internal_fullsize_shape(hdr->rank, hdr->shape)*hdr->size;
+            if (nbytes > ndfullsize(array)*size)
+                nbytes = ndfullsize(array)*size;
+            nd_internal_copy_rows(nddata(array), 
+                                  ndsize(array, rank-1)*size, 
+                                  ndpitch(array)*size,
+                                  olddata, 
+                                  ndsize(ptr, hdr->rank-1)*hdr->size,
+                                  ndpitch(ptr)*hdr->size,
+                                  nbytes);
+            ndfree(ptr);
+        }
+        return array;
+    }
+
+    olddata  = nd_internal_get_data(ptr, hdr->depth+1);
+    oldshape = hdr->shape;
+    oldrank  = hdr->rank;
+    oldclue  = hdr->clue;
+    oldallocator = hdr->allocator;
+
+    shapecopy = nd_internal_copy_shape(rank, shape);
+    if (shapecopy == NULL)
+        return NULL;
+
+    total_elements = nd_internal_fullsize_shape(rank, shapecopy);    
+
+    /* the old pointer table is refilled if it has the right length,
+       otherwise a new one is allocated and registered before the data
+       is touched, so that 'ptr' is still intact if that fails */
+    reuse = (rank > 1 && oldrank == rank 
+             && nd_internal_table_length(rank, shapecopy)
+                == nd_internal_table_length(oldrank, oldshape));
+    table = NULL;
+    if (rank > 1 && ! reuse) {
+        table = nd_internal_alloc_table(nd_internal_table_length(rank, shapecopy));
+        if (table != NULL && ndreg_add(table, &tableclue) != NDREG_SUCCESS) {
+            nd_internal_free_table(table);
+            table = NULL;
+        }
+        if (table == NULL) {
+            nd_internal_destroy_shape(shapecopy, 
+                                      nd_internal_shape_allocator(rank));
+            return NULL;
+        }
+    }
+
+    /* a shrinking resize moves the kept elements to their place
+       before the data is shrunk */
+    if (shrink)
+        nd_internal_move_kept(olddata, oldshape[rank-1]*size, 
+                              olddata, shapecopy[rank-1]*size, size, 
+                              rank, oldshape, shapecopy, 0, 0);
+
+    if (total_elements*size 
+        == nd_internal_fullsize_shape(oldrank, oldshape)*hdr->size) {
+        /* only the shape changes, so the data stays where it is and
+           stays registered */
+        data = olddata;
+        dataclue = nd_internal_get_header_address(olddata)->clue;
+    } else {
+        /* unregister the old data before it is released, as its
+           address may be reused by the new data */
+        ndreg_remove(olddata, nd_internal_get_header_address(olddata)->clue);
+        data = nd_internal_recreate_data(olddata, total_elements, size);
+        if (data == NULL && shrink) {
+            /* too late to fail, so keep the larger memory */
+            data = olddata;
+        } else if (data == NULL) {
+            ndreg_add(olddata, &clue);
+            nd_internal_get_header_address(olddata)->clue = clue;
+            if (table != NULL) {
+                ndreg_remove(table, tableclue);
+                nd_internal_free_table(table);
+            }
+            nd_internal_destroy_shape(shapecopy, 
+                                      nd_internal_shape_allocator(rank));
+            return NULL;
+        }
+        if (ndreg_add(data, &dataclue) != NDREG_SUCCESS) {
+            /* the old data is gone, so 'ptr' goes with it */
+            nd_internal_free_memory(nd_internal_get_header_address(data)->base,
+                                    nd_internal_get_header_address(data)->maplength,
+                                    nd_internal_get_header_address(data)->allocator);
+            if (table != NULL) {
+                ndreg_remove(table, tableclue);
+                nd_internal_free_table(table);
+            }
+            if (oldrank > 1)
+                (void)nd_internal_destroy_array(ptr, oldclue);
+            nd_internal_destroy_shape(oldshape, oldallocator);
+            nd_internal_destroy_shape(shapecopy, 
+                                      nd_internal_shape_allocator(rank));
+            return NULL;
+        }
+    }
+
+    /* from here on, nothing can fail */
+    if (grow)
+        nd_internal_move_kept(data, oldshape[rank-1]*size, 
+                              data, shapecopy[rank-1]*size, size, 
+                              rank, oldshape, shapecopy, 1, 
+                              total_elements*size);
+    nd_internal_destroy_shape(oldshape, oldallocator);
+    if (reuse) {
+        table = (char**)ptr;
+        tableclue = oldclue;
+    } else if (oldrank > 1)
+        (void)nd_internal_destroy_array(ptr, oldclue);
+        /* note: destroy array does an ndreg_remove of ptr */
+    if (rank > 1) {
+        nd_internal_fill_array(table, data, size, rank, shapecopy, 
+                               shapecopy[rank-1]);
+        nd_internal_create_header(table, rank, shapecopy, size, magic_mark, 0, 
+                                  tableclue);
+        nd_internal_create_header(data, 1, shapecopy+rank, size, view_magic_mark, 0, dataclue);
+        array = table;
+    } else {
+        nd_internal_create_header(data, 1, shapecopy, size, magic_mark, 0, dataclue);
+        array = data;
+    }
+    return array;
+}
+
+/***************************************************************************/
+
+void* sndrealloc( void*          ptr, 
+                  size_t         size, 
+                  short          rank, 
+                  const size_t*  shape )
+{
+ /* Changes the dimensions and/or the size of the multi-dimensional
+    array 'ptr'.  The content of the array will be unchanged in the
+    range from the start of the region up to the minimum of the old
+    and new sizes.  If the change in dimensions has changed the shape,
+    the elements get reassigned indices according to the row-major
+    ordering.  If the re-allocation is succesful, the new pointer is
+    returned and the old one is invalid.  If the function fails, NULL
+    is returned and 'ptr' is left intact. */
+
+    return nd_internal_realloc(ptr, size, rank, shape, 0);
+}
+
+/***************************************************************************/
+
+void* ndrealloc(void* ptr, size_t size, short rank, ...)
+{
+ /* Variadic version of sndrealloc. */
+
+    void*    result;
+    size_t*  shape;
+    size_t   buf[small_rank+1];
+    va_list  arglist;
+
+    va_start(arglist, rank);
+    shape = nd_internal_create_shape(rank, arglist, buf);
+    va_end(arglist);
+    result = sndrealloc(ptr, size, rank, shape);
+    nd_internal_destroy_va_shape(shape, buf);
+
+    return result;
+}
+
+/***************************************************************************/
+
+int ndrotate(void* ptr, ptrdiff_t shift)
+{
+ /* Rotate the first dimension of the nd array 'ptr' by 'shift', so that
+    ptr[i] becomes the old ptr[(i+shift) mod n0], by rotating only the
+    first-level pointers. */
+
+    struct header*  hdr;
+    size_t          n0, s;
+
+    if (! ndisknown(ptr))
+        return 0;
+    hdr = nd_internal_get_header_address(ptr);
+    if (hdr->rank <= 1 || hdr->depth < 1)
+        return 0;
+    n0 = hdr->shape[0];
+    if (n0 == 0)
+        return 1;
+    if (shift < 0)
+        s = n0 - (size_t)(-(shift + 1)) % n0 - 1;
+    else
+        s = (size_t)shift % n0;
+    nd_internal_rotate_pointers((char**)ptr, n0, s);
+    hdr->origin = (hdr->origin + n0 - s) % n0;
+    hdr->flags |= permuted_flag;
+    nd_internal_seal_header(ptr);
+    return 1;
+}
+
+/***************************************************************************/
+
+int ndpermute_rows(void* ptr, const size_t* perm)
+{
+ /* Reorder the first dimension of the nd array 'ptr' so that ptr[i]
+    becomes the old ptr[perm[i]], by reordering only the first-level
+    pointers. */
+
+    struct header*  hdr;
+    void**          rows;
+    void**          tmp;
+    char*           seen;
+    size_t          n0, i;
+
+    if (! ndisknown(ptr) || perm == NULL)
+        return 0;
+    hdr = nd_internal_get_header_address(ptr);
+    if (hdr->rank <= 1 || hdr->depth < 1)
+        return 0;
+    rows = ptr;
+    n0 = hdr->shape[0];
+    if (n0 == 0)
+        return 1;
+    tmp  = malloc(n0*sizeof(void*));
+    seen = calloc(n0, 1);
+    if (tmp == NULL || seen == NULL) {
+        free(tmp);
+        free(seen);
+        return 0;
+    }
+    for (i = 0; i < n0; i++) {
+        /* 'perm' has to be a permutation */
+        if (perm[i] >= n0 || seen[perm[i]]) {
+            free(tmp);
+            free(seen);
+            return 0;
+        }
+        seen[perm[i]] = 1;
+        tmp[i] = rows[perm[i]];
+    }
+    for (i = 0; perm[i] != hdr->origin; i++)
+        ;
+    hdr->origin = i;
+    hdr->flags |= permuted_flag;
+    nd_internal_seal_header(ptr);
+    memcpy(rows, tmp, n0*sizeof(void*));
+    free(tmp);
+    free(seen);
+    return 1;
+}
+
+/***************************************************************************/
+
+int ndcompact(void* ptr)
+{
+ /* Write the data of the nd array 'ptr' back in the order of its
+    indices after ndrotate or ndpermute_rows. */
+
+    struct header*  hdr;
+
+    if (! ndisknown(ptr))
+        return 0;
+    hdr = nd_internal_get_header_address(ptr);
+    /* views share their data, which can not be reordered for one */
+    if ((hdr->magic & 1) == 1)
+        return 0;
+    if (! (hdr->flags & permuted_flag))
+        return 1;
+    return nd_internal_compact(ptr);
+}
+
+
+/***************************************************************************/
+
+int ndswapdata(void* a, void* b)
+{
+ /* Exchange the data of the nd arrays 'a' and 'b', which must have the
+    same shape and layout, by exchanging the pointers to their rows.
+    Each array takes over the memory of the data it then points to.
+    The upper levels of a pointer table share the block of its
+    header, so they can not change owner, and the cost is one swap
+    per row of the last dimension rather than per first-level
+    entry. */
+
+    struct header*  ha;
+    struct header*  hb;
+    char**          rowsa;
+    char**          rowsb;
+    char*           tmp;
+    size_t          n0, nfirst, nlevel, offset, nrows, k, origin;
+    ptrdiff_t       ia, ib;
+    short           i, flags;
+
+    if (! ndisknown(a) || ! ndisknown(b))
+        return 0;
+    ha = nd_internal_get_header_address(a);
+    hb = nd_internal_get_header_address(b);
+    if ((ha->magic & 1) == 1 || (hb->magic & 1) == 1 
+        || ha->rank <= 1 || ha->rank != hb->rank || ha->size != hb->size 
+        || ha->depth != hb->depth 
+        || ((ha->flags ^ hb->flags) & ~permuted_flag) != 0
+        || (ha->flags & (single_block_flag|arena_flag|batch_flag)) != 0
+        || ndpitch(a) != ndpitch(b)
+        || ((ha->flags & reserved_flag) && ha->capacity != hb->capacity))
+        return 0;
+    for (i = 0; i < ha->rank; i++)
+        if (ha->shape[i] != hb->shape[i])
+            return 0;
+    if (a == b)
+        return 1;
+
+    /* the rows are in the last level of pointers */
+    n0 = ha->shape[0];
+    nfirst = (ha->flags & reserved_flag) ? ha->capacity : n0;
+    nlevel = nfirst;
+    nrows = n0;
+    offset = 0;
+    for (i = 1; i < ha->depth; i++) {
+        offset += nlevel;
+        nlevel *= ha->shape[i];
+        nrows *= ha->shape[i];
+    }
+    rowsa = (char**)a + offset;
+    rowsb = (char**)b + offset;
+    for (k = 0; k < nrows; k++) {
+        tmp = rowsa[k];
+        rowsa[k] = rowsb[k];
+        rowsb[k] = tmp;
+    }
+
+    /* the order of the rows goes with them, but when they are not the
+       first level, that level has to be reordered to match */
+    if (ha->depth > 1) {
+        for (k = 0; k < n0; k++) {
+            ia = (char**)((char**)a)[k] - ((char**)a + nfirst);
+            ib = (char**)((char**)b)[k] - ((char**)b + nfirst);
+            ((char**)a)[k] = (char*)((char**)a + nfirst + ib);
+            ((char**)b)[k] = (char*)((char**)b + nfirst + ia);
+        }
+    }
+    origin = ha->origin;
+    ha->origin = hb->origin;
+    hb->origin = origin;
+    flags = ha->flags;
+    ha->flags = (ha->flags & ~permuted_flag) | (hb->flags & permuted_flag);
+    hb->flags = (hb->flags & ~permuted_flag) | (flags & permuted_flag);
+
+    nd_internal_seal_header(a);
+    nd_internal_seal_header(b);
+
+    /* the data headers point to the shape of their owner */
+    nd_internal_get_header_address(nd_internal_get_data(a, ha->depth+1))->shape 
+        = ha->shape + ha->rank;
+    nd_internal_get_header_address(nd_internal_get_data(b, hb->depth+1))->shape 
+        = hb->shape + hb->rank;
+    nd_internal_seal_header(nd_internal_get_data(a, ha->depth+1));
+    nd_internal_seal_header(nd_internal_get_data(b, hb->depth+1));
+    return 1;
+}
+
+/***************************************************************************/
+
+static 
+int nd_internal_can_reserve(const void* ptr)
+{
+ /* Check whether capacity can be reserved in 'ptr', which must be a
+    known array that is not a view and whose shape, pointer table and
+    data were allocated separately. */
+
+    struct header* hdr;
+
+    if (! ndisknown(ptr))
+        return 0;
+    hdr = nd_internal_get_header_address(ptr);
+    return (hdr->magic & 1) == 0 
+        && (hdr->flags & ~(reserved_flag|permuted_flag)) == 0;
+}
+
+/***************************************************************************/
+
+static 
+void* nd_internal_reserve(void* ptr, size_t capacity)
+{
+ /* Reallocate the data of 'ptr' to hold 'capacity' rows of the first
+    dimension, and create a pointer table laid out for that many
+    rows, of which only the existing ones are filled in.  The shape
+    moves to the allocator of the new header if that differs.
+    Returns the new array, or NULL if that fails, in which case 'ptr'
+    is intact, unless the moved data could not be registered, which
+    releases 'ptr' as well. */
+
+    struct header*  hdr;
+    void*           olddata;
+    void*           data;
+    char**          table;
+    size_t*         shape;
+    size_t*         newshape;
+    size_t          size;
+    size_t          slice;
+    short           rank;
+    short           i;
+    ndreg_int       clue = NDREG_NOCLUE;
+    ndreg_int       tableclue = NDREG_NOCLUE;
+    ndreg_int       dataclue = NDREG_NOCLUE;
+    const ndallocator_t* oldallocator;
+    const ndallocator_t* allocator;
+
+    hdr   = nd_internal_get_header_address(ptr);
+    rank  = hdr->rank;
+    shape = hdr->shape;
+    size  = hdr->size;
+    oldallocator = hdr->allocator;
+    allocator = oldallocator;
+    newshape = shape;
+    slice = 1;
+    for (i = 1; i < rank; i++)
+        slice *= shape[i];
+
+    table = NULL;
+    if (rank > 1) {
+        table = nd_internal_alloc_table(
+                  capacity*(1 + nd_internal_table_length(rank-1, shape+1)));
+        if (table == NULL)
+            return NULL;
+        if (ndreg_add(table, &tableclue) != NDREG_SUCCESS) {
+            nd_internal_free_table(table);
+            return NULL;
+        }
+        allocator = nd_internal_get_header_address(table)->allocator;
+        if (allocator != oldallocator) 
+            newshape = nd_internal_copy_shape_using(rank, shape, allocator);
+        if (newshape == NULL) {
+            ndreg_remove(table, tableclue);
+            nd_internal_free_table(table);
+            return NULL;
+        }
+    }
+
+    olddata = nd_internal_get_data(ptr, hdr->depth+1);
+    ndreg_remove(olddata, nd_internal_get_header_address(olddata)->clue);
+    data = nd_internal_recreate_data(olddata, capacity*slice, size);
+    if (data == NULL) {
+        ndreg_add(olddata, &clue);
+        nd_internal_get_header_address(olddata)->clue = clue;
+        if (table != NULL) {
+            ndreg_remove(table, tableclue);
+            nd_internal_free_table(table);
+            if (newshape != shape)
+                nd_internal_destroy_shape(newshape, allocator);
+        }
+        return NULL;
+    }
+    /* for rank 1 the header, and so the shape, goes with the data */
+    if (rank == 1) {
+        allocator = nd_internal_get_header_address(data)->allocator;
+        if (allocator != oldallocator)
+            newshape = nd_internal_copy_shape_using(rank, shape, allocator);
+    }
+    if (newshape == NULL || ndreg_add(data, &dataclue) != NDREG_SUCCESS) {
+        /* the old data is gone, so 'ptr' goes with it */
+        if (newshape != NULL && newshape != shape)
+            nd_internal_destroy_shape(newshape, allocator);
+        nd_internal_free_memory(nd_internal_get_header_address(data)->base,
+                                nd_internal_get_header_address(data)->maplength,
+                                nd_internal_get_header_address(data)->allocator);
+        if (table != NULL) {
+            ndreg_remove(table, tableclue);
+            nd_internal_free_table(table);
+            (void)nd_internal_destroy_array(ptr, hdr->clue);
+        }
+        nd_internal_destroy_shape(shape, oldallocator);
+        return NULL;
+    }
+    if (newshape != shape) {
+        nd_internal_destroy_shape(shape, oldallocator);
+        shape = newshape;
+    }
+
+    if (rank > 1) {
+        nd_internal_fill_rows(table, data, size, rank, shape, shape[rank-1], 
+                              capacity, 0, shape[0]);
+        (void)nd_internal_destroy_array(ptr, hdr->clue);
+        nd_internal_create_header(table, rank, shape, size, magic_mark, 
+                                  reserved_flag, tableclue);
+        nd_internal_get_header_address(table)->capacity = capacity;
+        nd_internal_create_header(data, 1, shape+rank, size, view_magic_mark, 
+                                  reserved_flag, dataclue);
+        return table;
+    } else {
+        nd_internal_create_header(data, 1, shape, size, magic_mark, 
+                                  reserved_flag, dataclue);
+        nd_internal_get_header_address(data)->capacity = capacity;
+        return data;
+    }
+}
+
+/***************************************************************************/
+
+void* ndreserve(void* ptr, size_t capacity)
+{
+ /* Make room in the nd array 'ptr' for 'capacity' rows of the first
+    dimension, so that rows can be appended with ndappend without
+    reallocating. */
+
+    if (! nd_internal_can_reserve(ptr))
+        return NULL;
+    if (capacity <= ndcapacity(ptr))
+        return ptr;
+    if ((nd_internal_get_header_address(ptr)->flags & permuted_flag)
+        && ! nd_internal_compact(ptr))
+        return NULL;
+    return nd_internal_reserve(ptr, capacity);
+}
+
+/***************************************************************************/
+
+void* ndappend(void* ptr, size_t count)
+{
+ /* Add 'count' uninitialized rows to the first dimension of the nd
+    array 'ptr'.  If the capacity does not suffice, it is at least
+    doubled. */
+
+    struct header*  hdr;
+    size_t          n0, capacity, slice;
+    short           rank, i;
+
+    if (! nd_internal_can_reserve(ptr))
+        return NULL;
+    if ((nd_internal_get_header_address(ptr)->flags & permuted_flag)
+        && ! nd_internal_compact(ptr))
+        return NULL;
+    n0 = ndsize(ptr, 0);
+    capacity = ndcapacity(ptr);
+    if (n0 + count > capacity) {
+        capacity *= 2;
+        if (capacity < n0 + count)
+            capacity = n0 + count;
+        ptr = nd_internal_reserve(ptr, capacity);
+        if (ptr == NULL)
+            return NULL;
+    }
+    hdr = nd_internal_get_header_address(ptr);
+    rank = hdr->rank;
+    if (rank > 1) {
+        nd_internal_fill_rows((char**)ptr, nddata(ptr), hdr->size, rank, 
+                              hdr->shape, hdr->shape[rank-1], capacity, 
+                              n0, n0 + count);
+        slice = 1;
+        for (i = 1; i < rank; i++)
+            slice *= hdr->shape[i];
+        hdr->shape[rank] = (n0 + count)*slice;
+    }
+    hdr->shape[0] = n0 + count;
+    return ptr;
+}
+
+/***************************************************************************/
+
+void* sndresize(void* ptr, short rank, const size_t* shape)
+{
+ /* Changes the dimensions of the multi-dimensional array 'ptr' of
+    rank 'rank', keeping each element at the same multi-index.
+    Elements outside the new dimensions are dropped, and new elements
+    are zero.  If the function fails, NULL is returned and 'ptr' is
+    left intact. */
+
+    if (! ndisknown(ptr))
+        return NULL;
+    return nd_internal_realloc(ptr, nd_internal_get_header_address(ptr)->size,
+                               rank, shape, 1);
+}
+
+/***************************************************************************/
+
+void* ndresize(void* ptr, short rank, ...)
+{
+ /* Variadic version of sndresize. */
+
+    void*    result;
+    size_t*  shape;
+    size_t   buf[small_rank+1];
+    va_list  arglist;
+
+    va_start(arglist, rank);
+    shape = nd_internal_create_shape(rank, arglist, buf);
+    va_end(arglist);
+    result = sndresize(ptr, rank, shape);
+    nd_internal_destroy_va_shape(shape, buf);
+
+    return result;
+}
+
+/***************************************************************************/
+
+void ndfree(void* ptr)
+{
+ /* Free up all the memory allocated for the nd array 'ptr'. */
+
+    struct header*  hdr;
+
+    if (ndisknown(ptr)) {
+        hdr = nd_internal_get_header_address(ptr);
+        /* safe guard against freeing a 1d view, which can only be
+           created with nddata and ndcdata and should not be passed to
+           ndfree, as it is part of another nd array. */
+        if ( hdr->rank ==1 && (hdr->magic & 1) == 1 )
+            return;
+        if (cache_capacity != 0 && nd_internal_cache_park(ptr))
+            return;
+        if (deferred_free_mode)
+            nd_internal_free_deferred(ptr);
+        else
+            nd_internal_free(ptr);
+    } else if (! nd_internal_is_arena_array(ptr)) {
+        /* default to regular free is not a nd array */
+        free(ptr);
+    }
+}
+
+/***************************************************************************/
+
+void ndfree_deferred(void* ptr)
+{
+ /* Same as ndfree, but the memory of 'ptr' is released by a
+    background thread. */
+
+    struct header*  hdr;
+
+    if (ndisknown(ptr)) {
+        hdr = nd_internal_get_header_address(ptr);
+        if ( hdr->rank ==1 && (hdr->magic & 1) == 1 )
+            return;
+        if (cache_capacity != 0 && nd_internal_cache_park(ptr))
+            return;
+        nd_internal_free_deferred(ptr);
+    } else if (! nd_internal_is_arena_array(ptr))
+        free(ptr);
+}
+
+/***************************************************************************/
+
+void ndfree_flush(void)
+{
+ /* Wait until the background thread has released all memory queued
+    by ndfree_deferred. */
+
+#ifdef ND_HAVE_PTHREADS
+    pthread_mutex_lock(&reclaim_mutex);
+    while (reclaim_started && (reclaim_count > 0 || reclaim_busy))
+        pthread_cond_wait(&reclaim_idle, &reclaim_mutex);
+    pthread_mutex_unlock(&reclaim_mutex);
+#endif
+}
+
+/***************************************************************************/
+
+int ndisview(const void* ptr)
+{
+ /* Check if 'ptr' is an nd array created with (s)aview. */
+
+    struct header* hdr;
+
+    hdr = nd_internal_get_header_address(ptr);
+
+    return hdr != NULL 
+        && hdr->magic == view_magic_mark
+        && nd_internal_check_header(ptr, hdr);
+}
+
+/***************************************************************************/
+
+size_t ndsize(const void* ptr, short dim)
+{
+ /* Get the extent of nd array 'ptr' in any given dimension 'dim'. */
+
+    struct header* hdr;
+
+    hdr = nd_internal_get_header_address(ptr);
+    if (dim < hdr->rank)
+        return hdr->shape[dim];
+    else
+        return 0;
+}
+
+/***************************************************************************/
+
+void* nddata(void* ptr)
+{
+ /* Get the start of the data (useful for library calls).  Result is
+    undefined if 'ptr' was not created with (s)ndmalloc, (s)ndcalloc,
+    (s)ndrealloc, or (s)ndview. */
+
+    const struct header* hdr;
+
+    hdr = nd_internal_get_header_address(ptr);
+
+    return nd_internal_get_data(ptr, hdr->depth+1);
+}
+
+/***************************************************************************/
+
+const void* ndcdata(const void* ptr)
+{
+ /* Const version of nddata. */
+
+    return nd_internal_get_cdata(ptr, nd_internal_get_header_address(ptr)->depth+1);
+}
+
+/***************************************************************************/
+
+size_t ndcapacity(const void* ptr)
+{
+ /* Get the number of rows of the first dimension that the nd array
+    'ptr' can hold without reallocating. */
+
+    struct header* hdr;
+
+    hdr = nd_internal_get_header_address(ptr);
+    if (hdr->flags & reserved_flag)
+        return hdr->capacity;
+    else
+        return hdr->shape[0];
+}
+
+/***************************************************************************/
+
+short nddepth(const void* ptr)
+{
+ /* Get the number of levels of pointers of nd array 'ptr'. */
+
+    return nd_internal_get_header_address(ptr)->depth;
+}
+
+/***************************************************************************/
+
+short ndrank(const void* ptr)
+{
+ /* Get the rank of the multi-dimensional array.  Result is undefined
+    if 'ptr' was not created with (s)ndmalloc, (s)acalloc, (s)arealloc
+    or (s)aview. */
+
+    return nd_internal_get_header_address(ptr)->rank;
+}
+
+/***************************************************************************/
+
+const size_t* ndshape(const void* ptr)
+{
+ /* Get the shape of the nd array 'ptr'.  The result is undefined if
+    no nd array is associated with 'ptr'. */
+
+    return nd_internal_get_header_address(ptr)->shape;
+}
+
+/***************************************************************************/
+
+size_t ndfullsize(const void* ptr)
+{
+ /* Get the total number of elements in the nd array 'ptr'.  The
+    result is undefined if no nd array is associated with 'ptr'. */
+
+    struct header* hdr;
+
+    hdr = nd_internal_get_header_address(ptr);
+
+    return nd_internal_fullsize_shape(hdr->rank, hdr->shape);
+}
+
+/***************************************************************************/
+
+size_t ndalignment(const void* ptr)
+{
+ /* Determine the largest power of two that divides the address of
+    the data of the nd array 'ptr'. */
+
+    size_t address;
+
+    address = (size_t)ndcdata(ptr);
+    return address & (~address + 1);
+}
+
+/***************************************************************************/
+
+size_t ndpitch(const void* ptr)
+{
+ /* Get the number of elements between the starts of consecutive rows
+    of the last dimension in the data of the nd array 'ptr'. */
+
+    struct header* hdr;
+
+    hdr = nd_internal_get_header_address(ptr);
+    if (hdr->flags & pitched_flag)
+        return hdr->pitch;
+    else
+        return hdr->shape[hdr->rank > 1 ? hdr->rank-1 : 0];
+}
+
+/***************************************************************************/
+
+void* sndview( void*          data, 
+               size_t         size, 
+               short          rank, 
+               const size_t*  shape )
+{
+ /* Allocate a multi-dimensional view on existing data. */
+
+    size_t*    shapecopy;
+    void*      array;
+    ndreg_int  clue = NDREG_NOCLUE;
+
+    if (shape == NULL || data == NULL || rank <= 1) 
+        return NULL;
+
+    shapecopy = nd_internal_copy_shape(rank, shape);  
+    if (shapecopy == NULL)
+       return NULL;
+
+    /* if data is known array, use its data: */
+    if (ndisknown(data)) {
+        /* check that there are enough elements, without padding */
+        if (ndfullsize(data) < nd_internal_fullsize_shape(rank, shapecopy)
+            || (nd_internal_get_header_address(data)->flags 
+                & (pitched_flag|slice_flag))) {
+           nd_internal_destroy_shape(shapecopy, 
+                                     nd_internal_shape_allocator(rank));
+           return NULL;
+        }
+        /* get the data, not the pointer-to-pointer */
+        data = nddata(data);
+    }
+
+    array = nd_internal_create_array(data, size, rank, shapecopy, 
+                                     shapecopy[rank-1], &clue);
+    if (array == NULL) 
+        nd_internal_destroy_shape(shapecopy, 
+                                  nd_internal_shape_allocator(rank));
+    else 
+        nd_internal_create_header(array, rank, shapecopy, size, view_magic_mark, 0, clue);
+
+    return array;
+}
+/***************************************************************************/
+
+static 
+char* nd_internal_slice_row(void* ptr, const size_t* index)
+{
+ /* Get the start of the row of the last dimension of the known nd
+    array 'ptr' with multi-index 'index' in the other dimensions, by
+    following its pointer table and, for a partial table, counting
+    rows in its data.  In a periodic view, 'index' counts from the
+    start of the halo. */
+
+    struct header*  hdr;
+    char*           row;
+    size_t          offset;
+    short           i;
+
+    hdr = nd_internal_get_header_address(ptr);
+    row = (char*)ptr;
+    for (i = 0; i < hdr->depth; i++)
+        if (i > 0 && (hdr->flags & periodic_flag))
+            row = ((char**)row)[(ptrdiff_t)index[i] - (ptrdiff_t)hdr->halo];
+        else
+            row = ((char**)row)[index[i]];
+    offset = 0;
+    for (i = hdr->depth; i < hdr->rank-1; i++)
+        offset = offset*hdr->shape[i] + index[i];
+    return row + offset*hdr->shape[hdr->rank-1]*hdr->size;
+}
+
+/***************************************************************************/
+
+static 
+char** nd_internal_alloc_rows(short rank, const size_t* shape, 
+                              char*** rows, size_t* nrows)
+{
+ /* Allocate a pointer table for an array of rank>1 with dimensions
+    'shape', and fill in all but its last level, which holds the
+    '*nrows' pointers to the rows of the last dimension at '*rows'
+    and is left to the caller. */
+
+    char**  palloc;
+    char**  level;
+    char**  next;
+    size_t  j, n;
+    short   i;
+
+    palloc = nd_internal_alloc_table(nd_internal_table_length(rank, shape));
+    if (palloc == NULL)
+        return NULL;
+    level = palloc;
+    n = shape[0];
+    for (i = 0; i < rank-2; i++) {
+        next = level + n;
+        for (j = 0; j < n; j++)
+            level[j] = (char*)(next + j*shape[i+1]);
+        level = next;
+        n *= shape[i+1];
+    }
+    *rows = level;
+    *nrows = n;
+    return palloc;
+}
+
+/***************************************************************************/
+
+void* ndslice(void* ptr, const size_t* start, const size_t* stop, 
+              const size_t* step)
+{
+ /* Create a view on the elements of the known nd array 'ptr' from
+    'start' up to but not including 'stop' in every dimension, in
+    steps of 'step' (all 1 if 'step' is NULL).  Only the pointer table
+    is new: its rows point into the rows of 'ptr'. */
+
+    struct header*  hdr;
+    size_t*         shapecopy;
+    size_t          index[small_rank];
+    size_t          nrows, j, k, n, st;
+    char**          palloc;
+    char**          rows;
+    short           rank, i;
+    ndreg_int       clue = NDREG_NOCLUE;
+
+    if (! ndisknown(ptr) || start == NULL || stop == NULL)
+        return NULL;
+    hdr = nd_internal_get_header_address(ptr);
+    rank = hdr->rank;
+    if (rank <= 1 || rank > small_rank)
+        return NULL;
+    /* rows can be picked freely, but elements within rows can not */
+    if (step != NULL && step[rank-1] != 1)
+        return NULL;
+    for (i = 0; i < rank; i++)
+        if (start[i] > stop[i] || stop[i] > hdr->shape[i] 
+            || (step != NULL && step[i] == 0))
+            return NULL;
+
+    shapecopy = nd_internal_copy_shape(rank, stop);
+    if (shapecopy == NULL)
+        return NULL;
+    for (i = 0; i < rank; i++) {
+        st = (step != NULL) ? step[i] : 1;
+        shapecopy[i] = (stop[i] - start[i] + st - 1)/st;
+    }
+    nd_internal_set_shape(rank, shapecopy, shapecopy);
+
+    palloc = nd_internal_alloc_rows(rank, shapecopy, &rows, &nrows);
+    if (palloc == NULL) {
+        nd_internal_destroy_shape(shapecopy, 
+                                  nd_internal_shape_allocator(rank));
+        return NULL;
+    }
+
+    /* the last level points into the rows of 'ptr' */
+    for (j = 0; j < nrows; j++) {
+        k = j;
+        for (i = rank-2; i >= 0; i--) {
+            n = k % shapecopy[i];
+            k /= shapecopy[i];
+            index[i] = start[i] + n*((step != NULL) ? step[i] : 1);
+        }
+        rows[j] = nd_internal_slice_row(ptr, index) + start[rank-1]*hdr->size;
+    }
+
+    if (ndreg_add(palloc, &clue) != NDREG_SUCCESS) {
+        nd_internal_free_table(palloc);
+        nd_internal_destroy_shape(shapecopy, 
+                                  nd_internal_shape_allocator(rank));
+        return NULL;
+    }
+    nd_internal_create_header(palloc, rank, shapecopy, hdr->size, 
+                              view_magic_mark, slice_flag, clue);
+
+    return (void*)palloc;
+}
+
+/***************************************************************************/
+
+void* sndbroadcast(void* ptr, short rank, const size_t* shape)
+{
+ /* Create a view of rank 'rank' and dimensions 'shape' on the known nd
+    array 'ptr', in which dimensions of extent one of 'ptr', and
+    leading dimensions that 'ptr' does not have, are repeated.  The
+    rows of the new pointer table point into the rows of 'ptr'. */
+
+    struct header*  hdr;
+    size_t*         shapecopy;
+    size_t          index[small_rank];
+    size_t          nrows, j, k, n;
+    char**          palloc;
+    char**          rows;
+    short           offset, i;
+    ndreg_int       clue = NDREG_NOCLUE;
+
+    if (! ndisknown(ptr) || shape == NULL || rank <= 1 || rank > small_rank)
+        return NULL;
+    hdr = nd_internal_get_header_address(ptr);
+    offset = rank - hdr->rank;
+    if (offset < 0 || hdr->shape[hdr->rank-1] != shape[rank-1])
         return NULL;
+    for (i = offset; i < rank-1; i++)
+        if (hdr->shape[i-offset] != shape[i] && hdr->shape[i-offset] != 1)
+            return NULL;
 
-    shapecopy = nd_internal_copy_shape(rank, shape);  
+    shapecopy = nd_internal_copy_shape(rank, shape);
     if (shapecopy == NULL)
-       return NULL;
-
-    total_elements = nd_internal_fullsize_shape(rank, shapecopy);
-
-    data = nd_internal_create_data(total_elements, size);
-    if (data == NULL) {
-        nd_internal_destroy_shape(shapecopy);
+        return NULL;
+    palloc = nd_internal_alloc_rows(rank, shapecopy, &rows, &nrows);
+    if (palloc == NULL) {
+        nd_internal_destroy_shape(shapecopy, 
+                                  nd_internal_shape_allocator(rank));
         return NULL;
     }
 
-    array = nd_internal_create_array(data, size, rank, shapecopy, &clue);
-    if (array == NULL) {
-        nd_internal_destroy_shape(shapecopy);
-        nd_internal_destroy_data(data);
-    } else {
-        nd_internal_create_header(array, rank, shapecopy, magic_mark, clue);
-        if (rank > 1) {
-            ndreg_add(data, &clue);
-            nd_internal_create_header(data, 1, shapecopy+rank, view_magic_mark, clue);
+    /* repeated rows get the same pointer */
+    for (j = 0; j < nrows; j++) {
+        k = j;
+        for (i = rank-2; i >= 0; i--) {
+            n = k % shapecopy[i];
+            k /= shapecopy[i];
+            if (i >= offset)
+                index[i-offset] = (hdr->shape[i-offset] == 1) ? 0 : n;
         }
+        rows[j] = nd_internal_slice_row(ptr, index);
     }
 
-    return array;
+    if (ndreg_add(palloc, &clue) != NDREG_SUCCESS) {
+        nd_internal_free_table(palloc);
+        nd_internal_destroy_shape(shapecopy, 
+                                  nd_internal_shape_allocator(rank));
+        return NULL;
+    }
+    nd_internal_create_header(palloc, rank, shapecopy, hdr->size, 
+                              view_magic_mark, slice_flag, clue);
+
+    return (void*)palloc;
 }
 
 /***************************************************************************/
 
-void* ndmalloc(size_t size, short rank, ...)
+void* ndbroadcast(void* ptr, short rank, ...)
 {
- /* Variadic version of sndmalloc */
+ /* Variadic version of sndbroadcast */
 
     void*    result;
     size_t*  shape;
+    size_t   buf[small_rank+1];
     va_list  arglist;
 
     va_start(arglist, rank);
-    shape = nd_internal_create_shape(rank, arglist);
+    shape = nd_internal_create_shape(rank, arglist, buf);
     va_end(arglist);
-    result = sndmalloc(size, rank, shape); /* calls non-variadic function */
-    nd_internal_destroy_shape(shape);
+    result = sndbroadcast(ptr, rank, shape);
+    nd_internal_destroy_va_shape(shape, buf);
 
     return result;
 }
 
 /***************************************************************************/
 
-void* sndcalloc(size_t size, short rank, const size_t* shape)
+void* ndperiodic(void* ptr, size_t halo)
 {
- /* Same functionality as ndmalloc, but also initialized the array to
-    all zeros by calling 'calloc'. */
+ /* Create a view on the known nd array 'ptr' in which all dimensions
+    but the last are extended by 'halo' on both sides.  The rows of the
+    extension point to the rows of 'ptr' on the other side. */
 
-    size_t*    shapecopy;
-    void*      array;
-    void*      data;
-    size_t     total_elements;
-    ndreg_int  clue = NDREG_NOCLUE;
-    
-    if (shape == NULL) 
-        return NULL;
-    
-    shapecopy = nd_internal_copy_shape(rank, shape);  
-    if (shapecopy == NULL)
-       return NULL;
+    struct header*  hdr;
+    size_t          shape[small_rank];
+    size_t          index[small_rank];
+    size_t*         shapecopy;
+    size_t          nrows, j, k, n;
+    char**          palloc;
+    char**          rows;
+    short           rank, i;
+    ndreg_int       clue = NDREG_NOCLUE;
 
-    total_elements = nd_internal_fullsize_shape(rank, shapecopy);    
+    if (! ndisknown(ptr))
+        return NULL;
+    hdr = nd_internal_get_header_address(ptr);
+    rank = hdr->rank;
+    if (rank <= 1 || rank > small_rank)
+        return NULL;
+    for (i = 0; i < rank-1; i++) {
+        /* there is nothing to wrap around to in an empty dimension */
+        if (hdr->shape[i] == 0 || halo > ((size_t)-1 - hdr->shape[i])/2)
+            return NULL;
+        shape[i] = hdr->shape[i] + 2*halo;
+    }
+    shape[rank-1] = hdr->shape[rank-1];
 
-    data = nd_internal_create_clear_data(total_elements, size);
-    if (data == NULL) {
-        nd_internal_destroy_shape(shapecopy);    
+    shapecopy = nd_internal_copy_shape(rank, shape);
+    if (shapecopy == NULL)
+        return NULL;
+    palloc = nd_internal_alloc_rows(rank, shapecopy, &rows, &nrows);
+    if (palloc == NULL) {
+        nd_internal_destroy_shape(shapecopy, 
+                                  nd_internal_shape_allocator(rank));
         return NULL;
     }
 
-    array = nd_internal_create_array(data, size, rank, shapecopy, &clue);
-    if (array == NULL) {
-        nd_internal_destroy_shape(shapecopy);
-        nd_internal_destroy_data(data);
-    } else {
-        nd_internal_create_header(array, rank, shapecopy, magic_mark, clue);
-        if (rank > 1) {
-            ndreg_add(data, &clue);
-            nd_internal_create_header(data, 1, shapecopy+rank, view_magic_mark, clue);
+    /* row j of the view is row j-halo of 'ptr', modulo its shape */
+    for (j = 0; j < nrows; j++) {
+        k = j;
+        for (i = rank-2; i >= 0; i--) {
+            n = hdr->shape[i];
+            index[i] = (k % shapecopy[i] + n - halo % n) % n;
+            k /= shapecopy[i];
         }
+        rows[j] = nd_internal_slice_row(ptr, index);
     }
 
-    return array;
+    /* below the first level, which the header precedes, pointers point
+       past the halo, so that negative indices reach it */
+    for (j = 0; palloc + j < rows; j++)
+        palloc[j] = (char*)((char**)palloc[j] + halo);
+
+    if (ndreg_add(palloc, &clue) != NDREG_SUCCESS) {
+        nd_internal_free_table(palloc);
+        nd_internal_destroy_shape(shapecopy, 
+                                  nd_internal_shape_allocator(rank));
+        return NULL;
+    }
+    nd_internal_create_header(palloc, rank, shapecopy, hdr->size, 
+                              view_magic_mark, slice_flag|periodic_flag, clue);
+    nd_internal_get_header_address(palloc)->halo = halo;
+
+    return (void*)palloc;
 }
+
 /***************************************************************************/
 
-void* ndcalloc(size_t size, short rank, ...)
+void* ndview(void* data, size_t size, short rank, ...)
 {
- /* Variadic version of sndcalloc */
+ /* Variadic version of sndview */
 
     void*    result;
     size_t*  shape;
+    size_t   buf[small_rank+1];
     va_list  arglist;
 
     va_start(arglist, rank);
-    shape = nd_internal_create_shape(rank, arglist);
+    shape = nd_internal_create_shape(rank, arglist, buf);
     va_end(arglist);
-    result = sndcalloc(size, rank, shape); /* calls non-variadic function */
-    nd_internal_destroy_shape(shape);
+    result = sndview(data, size, rank, shape);
+    nd_internal_destroy_va_shape(shape, buf);
 
     return result;
 }
 
 /***************************************************************************/
 
-int ndisknown(const void* ptr)
+static 
+void* nd_internal_create_view_block(void* data, size_t size, short rank, 
+                                    const size_t* shape)
 {
- /* Check if 'ptr's is an array allocated with (s)ndmalloc,
-    (s)ndcalloc, (s)ndrealloc, or (s)ndview. */
+ /* Same functionality as sndview, but the shape, header and pointer
+    table of the view are placed in one block of memory, in that
+    order. */
 
-    struct header* hdr;
+    size_t                ntable, offset, maplength;
+    char*                 block;
+    void*                 array;
+    const ndallocator_t*  allocator;
+    ndreg_int             clue = NDREG_NOCLUE;
 
-    hdr = nd_internal_get_header_address(ptr);
+    if (data == NULL || rank <= 1) 
+        return NULL;
 
-    return hdr != NULL 
-        && (hdr->magic | 1) == (magic_mark | 1)
-        && ndreg_lookup(ptr, &(hdr->clue)) == NDREG_SUCCESS;
+    /* if data is known array, use its data: */
+    if (ndisknown(data)) {
+        /* check that there are enough elements, without padding */
+        if (ndfullsize(data) < nd_internal_memsize_shape(rank, shape, 0)
+            || (nd_internal_get_header_address(data)->flags 
+                & (pitched_flag|slice_flag)))
+           return NULL;
+        /* get the data, not the pointer-to-pointer */
+        data = nddata(data);
+    }
+
+    /* the block ends where a data header would start */
+    offset = nd_internal_block_offset(rank, shape, &ntable) - header_size;
+    block = nd_internal_alloc_memory(offset, alloc_uninit, ND_ALLOC_META,
+                                     &maplength, &allocator);
+    if (block == NULL)
+        return NULL;
+    nd_internal_set_shape(rank, shape, (size_t*)block);
+    array = block + offset - ntable*sizeof(char*);
+    (void)nd_internal_fill_array((char**)array, data, size, rank, 
+                                 (size_t*)block, shape[rank-1]);
+    if (ndreg_add(array, &clue) != NDREG_SUCCESS) {
+        nd_internal_free_memory(block, maplength, allocator);
+        return NULL;
+    }
+    nd_internal_create_header(array, rank, (size_t*)block, size, 
+                              view_magic_mark, single_block_flag, clue);
+    nd_internal_get_header_address(array)->base      = block;
+    nd_internal_get_header_address(array)->maplength = maplength;
+    nd_internal_get_header_address(array)->allocator = allocator;
+
+    return array;
 }
 
 /***************************************************************************/
 
-void* sndrealloc( void*          ptr, 
-                  size_t         size, 
-                  short          rank, 
-                  const size_t*  shape )
+static 
+void* nd_internal_malloc_fixed(size_t size, short rank, const size_t* shape,
+                               int clear)
 {
- /* Changes the dimensions and/or the size of the multi-dimensional
-    array 'ptr'.  The content of the array will be unchanged in the
-    range from the start of the region up to the minimum of the old
-    and new sizes.  If the change in dimensions has changed the shape,
-    the elements get reassigned indices according to the row-major
-    ordering.  If the re-allocation is succesful, the new pointer is
-    returned and the old one is invalid.  If the function fails, NULL
-    is returned.  Known bug: the original 'ptr' is still deallocated
-    when 'sndrealloc' fails. */
-
-    void*           array;
-    void*           olddata;
-    void*           data;
-    size_t          total_elements;
-    short           oldrank;
-    ndreg_int       oldclue;
-    size_t*         oldshape;
-    size_t*         shapecopy;
-    struct header*  hdr;
-    ndreg_int       clue = NDREG_NOCLUE;
-    
-    if (shape == NULL) 
-        return NULL;
-
-    hdr = nd_internal_get_header_address(ptr);
+ /* Common implementation of the fixed-rank allocation functions:
+    these take an array from the cache if possible, and otherwise
+    allocate the array as a single block. */
 
-    /* can only reshape ndmalloc arrays, not pointer, not views */
-    if (hdr == NULL || ! ndisknown(ptr) || (hdr->magic&1) == 1 )
-      return NULL;
+    void* array;
 
-    olddata  = nd_internal_get_data(ptr, rank);
-    oldshape = hdr->shape;
-    oldrank  = hdr->rank;
-    oldclue  = hdr->clue;
+    if (cache_capacity != 0) {
+        array = nd_internal_cache_take(size, rank, shape, clear);
+        if (array != NULL)
+            return array;
+    }
+    return nd_internal_create_block(size, rank, shape, 0, 0, clear);
+}
 
-    shapecopy = nd_internal_copy_shape(rank, shape);
+/***************************************************************************/
 
-    total_elements = nd_internal_fullsize_shape(rank, shapecopy);    
+void* ndmalloc1(size_t size, size_t n0)
+{
+ /* Same functionality as ndmalloc(size, 1, n0), with less overhead. */
 
-    data = nd_internal_recreate_data(olddata, total_elements, size);
-    if (data == NULL) {
-        nd_internal_destroy_shape(shapecopy);
-        return NULL;
-    }
-    array = nd_internal_create_array(data, size, rank, shapecopy, &clue);
-    if (array == NULL) {
-        nd_internal_destroy_shape(shapecopy);
-        /* we would want to reinstate olddata, but it has been recreated */
-        /* basically, if we get here, we are in bad shape.               */
-        nd_internal_destroy_data(data);       
-        return NULL;
-    } else {
-        nd_internal_create_header(array, rank, shapecopy, magic_mark, clue);
-        nd_internal_destroy_shape(oldshape);
-        if (oldrank > 1) {
-            ndreg_remove(olddata, nd_internal_get_header_address(data)->clue); 
-            /* data was realloc'ed, so data->clue is still the clue for the old data */
-            (void)nd_internal_destroy_array(ptr,oldclue);/*should check error status*/
-            /* note: destroy array does an ndreg_remove of ptr */
-        } else
-            ndreg_remove(ptr, oldclue);
-        if (rank > 1) {
-            ndreg_add(data, &clue); /* this could fail if we run out of memory */
-            nd_internal_create_header(data, 1, shapecopy+rank, view_magic_mark, clue);
-        }
-        return array;
-    }
+    return nd_internal_malloc_fixed(size, 1, &n0, 0);
 }
 
 /***************************************************************************/
 
-void* ndrealloc(void* ptr, size_t size, short rank, ...)
+void* ndmalloc2(size_t size, size_t n0, size_t n1)
 {
- /* Variadic version of sndrealloc. */
-
-    void*    result;
-    size_t*  shape;
-    va_list  arglist;
+ /* Same functionality as ndmalloc(size, 2, n0, n1), with less
+    overhead. */
 
-    va_start(arglist, rank);
-    shape = nd_internal_create_shape(rank, arglist);
-    va_end(arglist);
-    result = sndrealloc(ptr, size, rank, shape);
-    nd_internal_destroy_shape(shape);
+    size_t shape[2];
 
-    return result;
+    shape[0] = n0;
+    shape[1] = n1;
+    return nd_internal_malloc_fixed(size, 2, shape, 0);
 }
 
 /***************************************************************************/
 
-void ndfree(void* ptr)
+void* ndmalloc3(size_t size, size_t n0, size_t n1, size_t n2)
 {
- /* Free up all the memory allocated for the nd array 'ptr'. */
+ /* Same functionality as ndmalloc(size, 3, n0, n1, n2), with less
+    overhead. */
 
-    struct header*  hdr;
-    void*           data;
+    size_t shape[3];
 
-    if (ndisknown(ptr)) {
-        hdr = nd_internal_get_header_address(ptr);
-        /* safe guard against freeing a 1d view, which can only be
-           created with nddata and ndcdata and should not be passed to
-           ndfree, as it is part of another nd array. */
-        if ( hdr->rank ==1 && (hdr->magic & 1) == 1 )
-            return;
-        nd_internal_destroy_shape(hdr->shape);
-        /* for rank==1 data and array are the same */
-        /* views should not have their data freed */
-        if ( (hdr->rank > 1) && ((hdr->magic & 1) == 0) ) {
-            data = nd_internal_get_data(ptr, hdr->rank);
-            ndreg_remove(data, nd_internal_get_header_address(data)->clue);
-            nd_internal_destroy_data(data);
-        }
-        (void)nd_internal_destroy_array(ptr, hdr->clue);/* should check error status*/
-    } else {
-        /* default to regular free is not a nd array */
-        free(ptr);
-    }
+    shape[0] = n0;
+    shape[1] = n1;
+    shape[2] = n2;
+    return nd_internal_malloc_fixed(size, 3, shape, 0);
 }
 
 /***************************************************************************/
 
-int ndisview(const void* ptr)
+void* ndmalloc4(size_t size, size_t n0, size_t n1, size_t n2, size_t n3)
 {
- /* Check if 'ptr' is an nd array created with (s)aview. */
-
-    struct header* hdr;
+ /* Same functionality as ndmalloc(size, 4, n0, n1, n2, n3), with
+    less overhead. */
 
-    hdr = nd_internal_get_header_address(ptr);
+    size_t shape[4];
 
-    return hdr != NULL 
-        && hdr->magic == view_magic_mark
-        && ndreg_lookup(ptr, &(hdr->clue)) == NDREG_SUCCESS;
+    shape[0] = n0;
+    shape[1] = n1;
+    shape[2] = n2;
+    shape[3] = n3;
+    return nd_internal_malloc_fixed(size, 4, shape, 0);
 }
 
 /***************************************************************************/
 
-size_t ndsize(const void* ptr, short dim)
+void* ndcalloc1(size_t size, size_t n0)
 {
- /* Get the extent of nd array 'ptr' in any given dimension 'dim'. */
-
-    struct header* hdr;
+ /* Same functionality as ndcalloc(size, 1, n0), with less overhead. */
 
-    hdr = nd_internal_get_header_address(ptr);
-    if (dim < hdr->rank)
-        return hdr->shape[dim];
-    else
-        return 0;
+    return nd_internal_malloc_fixed(size, 1, &n0, 1);
 }
 
 /***************************************************************************/
 
-void* nddata(void* ptr)
+void* ndcalloc2(size_t size, size_t n0, size_t n1)
 {
- /* Get the start of the data (useful for library calls).  Result is
-    undefined if 'ptr' was not created with (s)ndmalloc, (s)ndcalloc,
-    (s)ndrealloc, or (s)ndview. */
+ /* Same functionality as ndcalloc(size, 2, n0, n1), with less
+    overhead. */
 
-    const struct header* hdr;
-
-    hdr = nd_internal_get_header_address(ptr);
+    size_t shape[2];
 
-    return nd_internal_get_data(ptr, hdr->rank);
+    shape[0] = n0;
+    shape[1] = n1;
+    return nd_internal_malloc_fixed(size, 2, shape, 1);
 }
 
 /***************************************************************************/
 
-const void* ndcdata(const void* ptr)
+void* ndcalloc3(size_t size, size_t n0, size_t n1, size_t n2)
 {
- /* Const version of nddata. */
+ /* Same functionality as ndcalloc(size, 3, n0, n1, n2), with less
+    overhead. */
+
+    size_t shape[3];
 
-    return nd_internal_get_cdata(ptr, nd_internal_get_header_address(ptr)->rank);
+    shape[0] = n0;
+    shape[1] = n1;
+    shape[2] = n2;
+    return nd_internal_malloc_fixed(size, 3, shape, 1);
 }
 
 /***************************************************************************/
 
-short ndrank(const void* ptr)
+void* ndcalloc4(size_t size, size_t n0, size_t n1, size_t n2, size_t n3)
 {
- /* Get the rank of the multi-dimensional array.  Result is undefined
-    if 'ptr' was not created with (s)ndmalloc, (s)acalloc, (s)arealloc
-    or (s)aview. */
+ /* Same functionality as ndcalloc(size, 4, n0, n1, n2, n3), with
+    less overhead. */
 
-    return nd_internal_get_header_address(ptr)->rank;
+    size_t shape[4];
+
+    shape[0] = n0;
+    shape[1] = n1;
+    shape[2] = n2;
+    shape[3] = n3;
+    return nd_internal_malloc_fixed(size, 4, shape, 1);
 }
 
 /***************************************************************************/
 
-const size_t* ndshape(const void* ptr)
+void* ndview2(void* data, size_t size, size_t n0, size_t n1)
 {
- /* Get the shape of the nd array 'ptr'.  The result is undefined if
-    no nd array is associated with 'ptr'. */
+ /* Same functionality as ndview(data, size, 2, n0, n1), with less
+    overhead. */
 
-    return nd_internal_get_header_address(ptr)->shape;
+    size_t shape[2];
+
+    shape[0] = n0;
+    shape[1] = n1;
+    return nd_internal_create_view_block(data, size, 2, shape);
 }
 
 /***************************************************************************/
 
-size_t ndfullsize(const void* ptr)
+void* ndview3(void* data, size_t size, size_t n0, size_t n1, size_t n2)
 {
- /* Get the total number of elements in the nd array 'ptr'.  The
-    result is undefined if no nd array is associated with 'ptr'. */
+ /* Same functionality as ndview(data, size, 3, n0, n1, n2), with less
+    overhead. */
 
-    struct header* hdr;
-
-    hdr = nd_internal_get_header_address(ptr);
+    size_t shape[3];
 
-    return nd_internal_fullsize_shape(hdr->rank, hdr->shape);
+    shape[0] = n0;
+    shape[1] = n1;
+    shape[2] = n2;
+    return nd_internal_create_view_block(data, size, 3, shape);
 }
 
 /***************************************************************************/
 
-void* sndview( void*          data, 
-               size_t         size, 
-               short          rank, 
-               const size_t*  shape )
+void* ndview4(void* data, size_t size, 
+              size_t n0, size_t n1, size_t n2, size_t n3)
 {
- /* Allocate a multi-dimensional view on existing data. */
+ /* Same functionality as ndview(data, size, 4, n0, n1, n2, n3), with
+    less overhead. */
 
-    size_t*    shapecopy;
-    void*      array;
-    ndreg_int  clue = NDREG_NOCLUE;
+    size_t shape[4];
 
-    if (shape == NULL || data == NULL || rank <= 1) 
-        return NULL;
+    shape[0] = n0;
+    shape[1] = n1;
+    shape[2] = n2;
+    shape[3] = n3;
+    return nd_internal_create_view_block(data, size, 4, shape);
+}
 
-    shapecopy = nd_internal_copy_shape(rank, shape);  
-    if (shapecopy == NULL)
-       return NULL;
+/***************************************************************************/
 
-    /* if data is known array, use its data: */
-    if (ndisknown(data)) {
-        /* check that there are enough elements */
-        if (ndfullsize(data) < nd_internal_fullsize_shape(rank, shapecopy))
-           return NULL;
-        /* get the data, not the pointer-to-pointer */
-        data = nddata(data);
+int ndmallopt(int param, size_t value)
+{
+ /* Set the global option 'param' to 'value'.  Returns 1 on success,
+    and 0 if 'param' is not a known option. */
+
+    switch (param) {
+      case ND_SINGLE_BLOCK:
+        single_block_mode = (value != 0);
+        return 1;
+#ifdef ND_HAVE_MMAP
+      case ND_MMAP_THRESHOLD:
+        mmap_threshold = value;
+        return 1;
+      case ND_MMAP_FLAGS:
+        mmap_flags = (int)value;
+        return 1;
+#endif
+#ifdef ND_HAVE_PTHREADS
+      case ND_DEFERRED_FREE:
+        deferred_free_mode = (value != 0);
+        return 1;
+#endif
+      case ND_CACHE_BYTES:
+        nd_internal_cache_lock();
+        cache_capacity = value;
+        nd_internal_cache_release(value, cache_slots);
+        nd_internal_cache_unlock();
+        return 1;
+      default:
+        return 0;
     }
+}
 
-    array = nd_internal_create_array(data, size, rank, shapecopy, &clue);
-    if (array == NULL) 
-        nd_internal_destroy_shape(shapecopy);
-    else 
-        nd_internal_create_header(array, rank, shapecopy, view_magic_mark, clue);
+/***************************************************************************/
 
-    return array;
+int ndset_allocator(int which, const ndallocator_t* allocator)
+{
+ /* Route the memory for data and/or metadata of arrays allocated
+    from now on to 'allocator', or back to malloc and free if
+    'allocator' is NULL. Returns 1 on success and 0 if 'which' or
+    'allocator' is invalid. */
+
+    if ((which & ~(ND_ALLOC_DATA|ND_ALLOC_META)) != 0 || which == 0
+        || (allocator != NULL 
+            && (allocator->malloc_fn == NULL || allocator->free_fn == NULL)))
+        return 0;
+    if (which & ND_ALLOC_DATA)
+        data_allocator = allocator;
+    if (which & ND_ALLOC_META)
+        meta_allocator = allocator;
+    return 1;
 }
+
 /***************************************************************************/
 
-void* ndview(void* data, size_t size, short rank, ...)
+int ndset_thread_allocator(int which, const ndallocator_t* allocator)
 {
- /* Variadic version of sndview */
+ /* Same as ndset_allocator, but only for the calling thread, in
+    which it overrides the allocator set by ndset_allocator until it
+    is set to NULL again.  Returns 0 if there is no thread-local
+    storage. */
+
+    if ((which & ~(ND_ALLOC_DATA|ND_ALLOC_META)) != 0 || which == 0
+        || (allocator != NULL 
+            && (allocator->malloc_fn == NULL || allocator->free_fn == NULL)))
+        return 0;
+#ifdef ND_THREAD_LOCAL
+    if (which & ND_ALLOC_DATA)
+        thread_data_allocator = allocator;
+    if (which & ND_ALLOC_META)
+        thread_meta_allocator = allocator;
+    return 1;
+#else
+    return 0;
+#endif
+}
 
-    void*    result;
-    size_t*  shape;
-    va_list  arglist;
+/***************************************************************************/
 
-    va_start(arglist, rank);
-    shape = nd_internal_create_shape(rank, arglist);
-    va_end(arglist);
-    result = sndview(data, size, rank, shape);
-    nd_internal_destroy_shape(shape);
+size_t ndcache_trim(size_t bytes)
+{
+ /* Free the arrays parked in the cache, oldest first, until at most
+    'bytes' bytes remain parked, and return the number of bytes that
+    remain. */
 
+    size_t result;
+
+    nd_internal_cache_lock();
+    nd_internal_cache_release(bytes, cache_slots);
+    result = cache_bytes;
+    nd_internal_cache_unlock();
     return result;
 }
 
+/***************************************************************************/
+
+void ndcache_stats(size_t* hits, size_t* misses, size_t* bytes)
+{
+ /* Report the number of allocations served from the cache, the
+    number of allocations that were looked up in the cache but not
+    found, and the number of bytes currently parked.  Any of the
+    pointers may be NULL. */
+
+    nd_internal_cache_lock();
+    if (hits != NULL)
+        *hits = cache_hits;
+    if (misses != NULL)
+        *misses = cache_misses;
+    if (bytes != NULL)
+        *bytes = cache_bytes;
+    nd_internal_cache_unlock();
+}
+
 /***************************************************************************/
 /* end of file ndmalloc.c */
@@ -25,6 +25,8 @@ void* ndcalloc   (size_t size, short rank, ...);
 void* ndrealloc  (void* ptr,  size_t size, short rank, ...);
 void* ndview     (void* data, size_t size, short rank, ...); 
 void  ndfree     (void* ptr);
+void  ndfree_deferred (void* ptr);
+void  ndfree_flush    (void);
 /* */
 void* sndmalloc  (size_t size, short rank, const size_t* n);
 void* sndcalloc  (size_t size, short rank, const size_t* n);
@@ -57,6 +59,17 @@ void* sndview    (void* data, size_t size, short rank, const size_t* n);
  *  'ptr' is not associated with a multi-dimensional array, ndfree
  *  attempts a call to the regular 'free' function from stdlib.h.
  *
+ *  The 'ndfree_deferred' function does the same as 'ndfree', but
+ *  only unregisters the array right away and queues its memory to be
+ *  released by a background thread, which is started on first use.
+ *  This keeps the cost of unmapping large arrays out of the calling
+ *  thread.  If the queue (of 1024 memory blocks) is full, the caller
+ *  blocks until the background thread has released enough blocks to
+ *  make room; if threads are not available, the memory is released
+ *  right away.  The 'ndfree_flush' function waits until all queued
+ *  memory has been released.  Note that user-supplied allocators (see
+ *  'ndset_allocator') then get called from the background thread.
+ *
  *  The 'ndview' function is similar to ndmalloc but only allocates the
  *  pointer-to pointer array, while the elements of the array should
  *  be a contiguous block pointed to by 'data'. 'rank' must be larger
@@ -74,8 +87,13 @@ void* sndview    (void* data, size_t size, short rank, const size_t* n);
  *  changed the shape, the elements get reassigned indices according
  *  to the row-major ordering.  If the re-allocation is successful,
  *  the new pointer is returned and the old one is invalid.  If the
- *  function fails, NULL is returned.  Known bug: the original 'ptr'
- *  is still deallocated when 'ndrealloc' fails.
+ *  function fails, NULL is returned and 'ptr' is left intact, except
+ *  in the unlikely case that the registry fails to take the moved
+ *  data, in which case 'ptr' is released as well.  If the number of
+ *  bytes does not change, only the pointer-to-pointer structure is
+ *  rebuilt and the data stays in place, and data in a memory mapping
+ *  (see ND_MMAP_THRESHOLD) is grown or shrunk without copying where
+ *  the system supports it.
  *
  *  The functions 'sndmalloc', 'sndcalloc' and 'sndrealloc' are
  *  non-variadic variants of 'ndmalloc', 'acalloc' and 'arealloc',
@@ -83,24 +101,417 @@ void* sndview    (void* data, size_t size, short rank, const size_t* n);
  *  argument 'n'.
  */
 
+/* Variants of ndmalloc and ndcalloc with aligned data. */
+void* ndmalloc_aligned  (size_t size, size_t align, short rank, ...);
+void* ndcalloc_aligned  (size_t size, size_t align, short rank, ...);
+void* sndmalloc_aligned (size_t size, size_t align, short rank, const size_t* n);
+void* sndcalloc_aligned (size_t size, size_t align, short rank, const size_t* n);
+/* Description:
+ *  The functions 'ndmalloc_aligned' and 'ndcalloc_aligned' have the
+ *  same functionality as 'ndmalloc' and 'ndcalloc', respectively,
+ *  except that the data of the array starts at an address that is a
+ *  multiple of 'align' bytes, e.g. 64 for cache lines and AVX-512
+ *  vectors, 4096 for pages, or 2097152 for huge pages.  'align' must
+ *  be a power of two, otherwise NULL is returned.  Up to 'align'
+ *  bytes of memory are allocated in addition to the data.  The
+ *  alignment is preserved by 'ndrealloc', which, for these arrays,
+ *  always copies the data into a new array and leaves 'ptr' intact
+ *  if it fails.  Note that only the start of the data is aligned;
+ *  rows other than the first are aligned only if the size of a row is
+ *  a multiple of 'align'.  The functions 'sndmalloc_aligned' and
+ *  'sndcalloc_aligned' are the non-variadic variants.
+ */
+
+/* Variants of ndmalloc and ndcalloc with padded rows. */
+void* ndmalloc_pitched  (size_t size, size_t pitch, short rank, ...);
+void* ndcalloc_pitched  (size_t size, size_t pitch, short rank, ...);
+void* sndmalloc_pitched (size_t size, size_t pitch, short rank, const size_t* n);
+void* sndcalloc_pitched (size_t size, size_t pitch, short rank, const size_t* n);
+/* Description:
+ *  The functions 'ndmalloc_pitched' and 'ndcalloc_pitched' have the
+ *  same functionality as 'ndmalloc' and 'ndcalloc', respectively,
+ *  except that consecutive rows of the last dimension start 'pitch'
+ *  elements apart in memory, instead of n['rank'-1].  'pitch' may not
+ *  be less than n['rank'-1], otherwise NULL is returned.  If 'pitch'
+ *  is zero, it is chosen automatically: rows are padded to whole
+ *  cache lines, and by one more cache line if they would otherwise
+ *  be a multiple of 512 bytes long.  This avoids rows that are a
+ *  power of two apart, which map onto the same cache sets and cause
+ *  conflict misses when accessing columns or stencils.  The data
+ *  starts at a cache line boundary.  Indexing as a[i][j] is not
+ *  affected by the padding.  Padding elements are uninitialized for
+ *  'ndmalloc_pitched' and zero for 'ndcalloc_pitched'.  For a
+ *  pitched array, the elements are not contiguous: element
+ *  [i]...[j][k] is found at nddata(a)[(i*...*n['rank'-2]+...+j)*pitch+k].
+ *  Views can not be made on pitched arrays. 'ndrealloc' keeps the
+ *  pitch if the new rows fit, and otherwise chooses one automatically;
+ *  it copies the data into a new array and leaves 'ptr' intact if it
+ *  fails.  For arrays of rank one, the pitch is ignored.  The
+ *  functions 'sndmalloc_pitched' and 'sndcalloc_pitched' are the
+ *  non-variadic variants.
+ */
+
+/* Variant of ndcalloc for NUMA systems. */
+void* ndcalloc_parallel  (size_t size, int nthreads, int policy, short rank, ...);
+void* sndcalloc_parallel (size_t size, int nthreads, int policy, short rank, const size_t* n);
+#define ND_NUMA_FIRSTTOUCH 0
+#define ND_NUMA_INTERLEAVE 1
+#define ND_NUMA_BIND       2
+/* Description:
+ *  The function 'ndcalloc_parallel' has the same functionality as
+ *  'ndcalloc', but the array is zeroed by 'nthreads' threads (or as
+ *  many threads as there are processors if 'nthreads' is zero or
+ *  negative).  The rows of the first dimension, and the part of the
+ *  pointer-to-pointer structure that points into them, are divided
+ *  into 'nthreads' contiguous parts in the same way as an OpenMP loop
+ *  over the first index with a static schedule divides them.  With
+ *  the policies ND_NUMA_FIRSTTOUCH and ND_NUMA_BIND, part t of
+ *  'nthreads' goes to node t*nnodes/nthreads of the 'nnodes' nodes
+ *  that the process may use: its thread is pinned to the cpus of that
+ *  node, whatever the affinity of the calling thread, and with
+ *  ND_NUMA_BIND its pages are also bound to that node.  This is the
+ *  node on which thread t of a loop like
+ *    #pragma omp parallel for schedule(static)
+ *    for (i = 0; i < n[0]; i++) ... a[i] ...
+ *  runs when OMP_PROC_BIND=close or spread places 'nthreads' threads
+ *  over all nodes in order, so that the loop accesses mostly local
+ *  memory.  With ND_NUMA_BIND, the pointer-to-pointer structure is
+ *  bound to the nodes that are used.  The policy ND_NUMA_INTERLEAVE
+ *  spreads the pages round-robin over all nodes.  Other policies
+ *  return NULL.  The array is always allocated as a single block
+ *  with an anonymous memory mapping (see 'ndmallopt').  On systems
+ *  without NUMA or with a single node, only the parallel zeroing
+ *  remains; without memory mappings, 'ndcalloc_parallel' is the same
+ *  as 'ndcalloc'.  'ndrealloc' does not preserve the placement.  The
+ *  function 'sndcalloc_parallel' is the non-variadic variant.
+ */
+
+/* Arenas from which many multi-dimensional arrays can be allocated
+ * and released at once.
+ */
+typedef struct ndarena ndarena_t;
+ndarena_t* ndarena_create  (size_t bytes);
+void*      ndarena_malloc  (ndarena_t* arena, size_t size, short rank, ...);
+void*      ndarena_calloc  (ndarena_t* arena, size_t size, short rank, ...);
+void*      sndarena_malloc (ndarena_t* arena, size_t size, short rank, const size_t* n);
+void*      sndarena_calloc (ndarena_t* arena, size_t size, short rank, const size_t* n);
+void       ndarena_reset   (ndarena_t* arena);
+void       ndarena_destroy (ndarena_t* arena);
+/* Description:
+ *  The function 'ndarena_create' creates an arena with room for about
+ *  'bytes' bytes, or returns NULL if that memory can not be allocated.
+ *
+ *  The functions 'ndarena_malloc' and 'ndarena_calloc' have the same
+ *  functionality as 'ndmalloc' and 'ndcalloc', but place the internal
+ *  header, shape, pointer-to-pointer structure and data of the array
+ *  consecutively in the arena, which only takes moving a pointer.  If
+ *  the arena is full, another chunk of at least the initial size is
+ *  added to it. The arrays can be used with 'ndrank', 'ndsize',
+ *  'ndfullsize', 'nddata', 'ndcdata', 'ndshape', 'ndpitch' and
+ *  'ndalignment', but they are not registered, so 'ndisknown'
+ *  returns 0 for them.  They belong to the arena: 'ndfree' ignores
+ *  them, 'ndrealloc' returns NULL for them, and views of them should
+ *  be made of their 'nddata'.
+ *  The functions 'sndarena_malloc' and 'sndarena_calloc' are the
+ *  non-variadic variants.
+ *
+ *  The function 'ndarena_reset' releases all arrays in the arena at
+ *  once, after which the arena can be reused.  This takes constant
+ *  time: chunks that were added to the arena are kept, and filled
+ *  again after the first one, so that an arena that is reset, e.g.,
+ *  every time step, stops allocating memory once it has grown to the
+ *  size needed.
+ *
+ *  The function 'ndarena_destroy' releases all arrays in the arena
+ *  and the arena itself.
+ *
+ *  An arena should not be used by more than one thread at a time.
+ */
+
+/* Allocation of many arrays of the same shape at once */
+int  ndmalloc_batch  (size_t size, size_t count, void** arrays, short rank, ...);
+int  ndcalloc_batch  (size_t size, size_t count, void** arrays, short rank, ...);
+int  sndmalloc_batch (size_t size, size_t count, void** arrays, short rank, const size_t* n);
+int  sndcalloc_batch (size_t size, size_t count, void** arrays, short rank, const size_t* n);
+void ndfree_batch    (void** arrays, size_t count);
+/* Description:
+ *  The functions 'ndmalloc_batch' and 'ndcalloc_batch' allocate
+ *  'count' arrays with the same functionality as 'ndmalloc' and
+ *  'ndcalloc', all with elements of 'size' bytes and the same shape,
+ *  and store them in arrays[0] to arrays['count'-1].  The arrays are
+ *  laid out one after the other in a single block of memory, each as
+ *  with the ND_SINGLE_BLOCK option of 'ndmallopt', and are registered
+ *  together.  The functions return 1 on success, and 0 if the memory
+ *  could not be allocated. The functions 'sndmalloc_batch' and
+ *  'sndcalloc_batch' are the non-variadic variants.
+ *
+ *  The arrays are normal arrays, which can be freed separately with
+ *  'ndfree'; the memory of the batch is released when its last array
+ *  is freed.  The function 'ndfree_batch' frees the 'count' arrays in
+ *  'arrays', which is fastest if these are all arrays left of one
+ *  batch.
+ */
+
+/* Changing the dimensions while keeping the multi-indices of elements */
+void* ndresize  (void* ptr, short rank, ...);
+void* sndresize (void* ptr, short rank, const size_t* n);
+/* Description:
+ *  The 'ndresize' function changes the dimensions of the
+ *  multi-dimensional array 'ptr' of rank 'rank' to those given as the
+ *  variable-length arguments, but unlike 'ndrealloc' it keeps every
+ *  element at the same multi-index: a[i][j] of a 100x100 array
+ *  resized to 120x120 is still a[i][j].  Elements outside the new
+ *  dimensions are dropped and new elements are zero.  The rank and
+ *  element size can not be changed.  If all dimensions grow or all
+ *  shrink, the rows are moved within the same memory; large arrays
+ *  have their rows moved by several threads.  Otherwise, and for
+ *  arrays that are single blocks, aligned, pitched or have fewer
+ *  levels of pointers, a new array of the same kind is created.  If
+ *  the resize is successful, the new pointer is returned and the old
+ *  one is invalid.  If the function fails, NULL is returned and 'ptr'
+ *  is left intact, with the same exception as for 'ndrealloc'.  The
+ *  function 'sndresize' is the non-variadic variant.
+ */
+
+/* Views on strided parts of arrays */
+void* ndslice (void* ptr, const size_t* start, const size_t* stop, const size_t* step);
+/* Description:
+ *  The 'ndslice' function creates a view on part of the
+ *  multi-dimensional array 'ptr', without copying data: dimension d
+ *  of the view runs over the elements start[d], start[d]+step[d],
+ *  ... up to but not including stop[d] of 'ptr'.  If 'step' is NULL,
+ *  all steps are one.  For instance, with start = {10,20}, stop =
+ *  {90,80} and step = {2,1}, s[i][j] is a[10+2*i][20+j].  Only a new
+ *  pointer-to-pointer structure is allocated, whose rows point into
+ *  the rows of 'ptr', so the step in the last dimension must be one.
+ *  'ptr' can be any known array of rank 2 to 8, including views and
+ *  other slices.  NULL is returned if the ranges do not fit in 'ptr'
+ *  or memory runs out.  The slice is a view, reports its own shape
+ *  with 'ndshape' and 'ndsize', is freed with 'ndfree', and is
+ *  invalid once 'ptr' is freed.  Its data is not contiguous: 'nddata'
+ *  returns its first element, 'ndpitch' is meaningless, and views
+ *  can not be made on it.
+ */
+
+/* Broadcasting views with repeated rows */
+void* ndbroadcast  (void* ptr, short rank, ...);
+void* sndbroadcast (void* ptr, short rank, const size_t* n);
+/* Description:
+ *  The 'ndbroadcast' function creates a view of rank 'rank' on the
+ *  multi-dimensional array 'ptr', with the dimensions given as the
+ *  variable-length arguments.  The dimensions of 'ptr' are matched
+ *  with the last ones of the view.  Where 'ptr' has an extent of one,
+ *  or has no dimension at all, the view repeats it by pointing rows
+ *  of its pointer-to-pointer structure to the same row of 'ptr'.  For
+ *  instance, for a profile 'p' of n1 doubles,
+ *
+ *      double** b = ndbroadcast(p, 2, n0, n1);
+ *
+ *  gives b[i][j] == p[j] for all i, without copying 'p'.  The last
+ *  dimension must equal that of 'ptr', as elements within a row
+ *  can not be repeated, and 'rank' can be at most 8.  NULL is
+ *  returned if the dimensions do not match or memory runs out.
+ *  Writing to the view writes to all repetitions at once.  Like a
+ *  slice (see 'ndslice'), the view is freed with 'ndfree', is invalid
+ *  once 'ptr' is freed, and its data is not contiguous.  The
+ *  function 'sndbroadcast' is the non-variadic variant.
+ */
+
+/* Periodic views with wrapped-around halo rows */
+void* ndperiodic (void* ptr, size_t halo);
+/* Description:
+ *  The 'ndperiodic' function creates a view on the multi-dimensional
+ *  array 'ptr' for periodic boundaries, in which every dimension but
+ *  the last is extended by 'halo' on both sides, without copying
+ *  data.  The rows in the extension point to the rows at the other
+ *  side of 'ptr', so that for a 2-d array 'a' of n0 by n1 elements,
+ *
+ *      double** p = ndperiodic(a, 1);
+ *
+ *  has p[i+1][j] == a[i][j], while p[0] aliases a[n0-1] and p[n0+1]
+ *  aliases a[0], and a stencil loop over i from 1 to n0 needs no
+ *  branches or ghost rows.  Within a row, the last dimension can not
+ *  wrap around.  The view reports its extended shape with 'ndshape'.
+ *  As the hidden header of an array sits right before its pointers,
+ *  the first dimension of the view is indexed from the start of its
+ *  halo, but the other dimensions are indexed from the start of
+ *  'ptr', so that for a 3-d array 'a',
+ *
+ *      double*** q = (double***)ndperiodic(a, 1) + 1;
+ *
+ *  has q[i][j][k] == a[i][j][k], with q[-1][j] aliasing a[n0-1][j],
+ *  q[i][-1] aliasing a[i][n1-1], q[n0] aliasing a[0], and so on.
+ *  Only the view itself, not 'q', can be passed to the other
+ *  functions, such as 'ndfree', which index it from the start of
+ *  the halo in every dimension.  NULL is returned
+ *  for arrays with rank 1 or above 8, with empty dimensions other
+ *  than the last, or when memory runs out.  Like a slice (see
+ *  'ndslice'), the view is freed with 'ndfree', is invalid once 'ptr'
+ *  is freed, and its data is not contiguous.
+ */
+
+/* Rotating rows and exchanging data through the pointers */
+int ndrotate   (void* ptr, ptrdiff_t shift);
+int ndswapdata (void* a, void* b);
+/* Description:
+ *  The 'ndrotate' function rotates the first dimension of the
+ *  multi-dimensional array 'ptr' by 'shift', so that ptr[i] refers to
+ *  what was ptr[(i+shift) mod ndsize(ptr,0)].  Only the pointers of
+ *  the first level are moved, not the data, which makes a ring
+ *  buffer of rows:
+ *
+ *      ndrotate(hist, 1);
+ *      memcpy(hist[n0-1], latest, n1*sizeof(double));
+ *
+ *  drops the oldest row and reuses it as the newest.  The 'ndswapdata'
+ *  function exchanges the data of the arrays 'a' and 'b' by exchanging
+ *  the pointers to their rows, e.g., to flip the old and new grids of
+ *  a time-stepping loop.  Each array then owns and frees the memory
+ *  of its new data.  No data is copied, but the pointer tables stay
+ *  with their arrays, so every pointer to a row of the last dimension
+ *  is exchanged: ndsize(a,0)*...*ndsize(a,rank-2) of them, which is
+ *  the first level only for rank 2, and the full last level of
+ *  pointers for higher ranks.  Both functions return 1 on success and 0 if the
+ *  arrays are not known or have rank 1.  'ndswapdata' also returns 0
+ *  unless 'a' and 'b' have the same element size, shape, number of
+ *  pointer levels and flags, or if they are views, single blocks, or
+ *  allocated in an arena or a batch.  The function 'nddata', the
+ *  'ndvla' macros and views see the data in memory order, i.e., as
+ *  before the rotation, while 'ndrealloc', 'ndresize', 'ndreserve'
+ *  and 'ndappend' first put the data itself back into the order of
+ *  the indices with 'ndcompact' (see below).
+ */
+
+/* Permuting rows without moving data */
+int ndpermute_rows (void* ptr, const size_t* perm);
+int ndcompact      (void* ptr);
+/* Description:
+ *  The 'ndpermute_rows' function reorders the first dimension of the
+ *  multi-dimensional array 'ptr' so that ptr[i] refers to what was
+ *  ptr[perm[i]], for 'perm' a permutation of 0..ndsize(ptr,0)-1.  As
+ *  with 'ndrotate', only the pointers of the first level are moved,
+ *  so a row swap during pivoting or sorting costs a pointer swap, not
+ *  a copy of the row.  To keep the original order as well, permute a
+ *  view made with 'ndview' instead.  The 'ndcompact' function writes
+ *  the data of 'ptr' back in the order of its indices, so that the
+ *  data is contiguous in that order again, e.g., for 'nddata' or I/O.
+ *  It takes time proportional to the size of the data, but no extra
+ *  memory for it, and views of 'ptr' then see the new memory order.
+ *  Both functions return 1 on success and 0 if 'ptr' is not known,
+ *  or memory for the bookkeeping runs out.  'ndpermute_rows' also
+ *  returns 0 for arrays of rank 1 and if 'perm' is not a permutation,
+ *  and 'ndcompact' for views, whose data belongs to another array.
+ */
+
+/* Growing the first dimension with reserved capacity */
+void*  ndreserve  (void* ptr, size_t capacity);
+void*  ndappend   (void* ptr, size_t count);
+/* Description:
+ *  The 'ndreserve' function makes room in the multi-dimensional array
+ *  'ptr' for 'capacity' rows of the first dimension, i.e.,
+ *  'capacity'*ndsize(ptr,1)*...*ndsize(ptr,rank-1) elements, without
+ *  changing its shape.  The 'ndappend' function adds 'count' rows to
+ *  the first dimension of 'ptr', so that ndsize(ptr,0) grows by
+ *  'count'.  The new elements are not initialized.  If the capacity
+ *  does not suffice, 'ndappend' first reserves at least twice the
+ *  capacity, so that appending rows one at a time takes amortized
+ *  constant time per row.  Only the pointers of the new rows are
+ *  filled in.  Both functions return the array, which moves when
+ *  memory is reserved, so the old pointer becomes invalid then, or
+ *  NULL if the memory could not be allocated, in which case 'ptr'
+ *  is left intact (with the same exception as for 'ndrealloc').
+ *  They also return NULL for views, and for arrays that are single
+ *  blocks, aligned, pitched or have fewer levels of pointers.
+ *  'ndcapacity' returns the current capacity.
+ *  'ndrealloc' and 'ndresize' do not keep the reserved capacity.
+ */
+
+/* Allocation with fewer levels of pointers */
+void* ndmalloc_depth  (size_t size, short depth, short rank, ...);
+void* ndcalloc_depth  (size_t size, short depth, short rank, ...);
+void* sndmalloc_depth (size_t size, short depth, short rank, const size_t* n);
+void* sndcalloc_depth (size_t size, short depth, short rank, const size_t* n);
+/* Description:
+ *  The functions 'ndmalloc_depth' and 'ndcalloc_depth' have the same
+ *  functionality as 'ndmalloc' and 'ndcalloc', but build only 'depth'
+ *  levels of pointers instead of rank-1.  The last level points to
+ *  contiguous blocks holding the trailing rank-'depth' dimensions,
+ *  which are indexed with fixed sizes by the caller.  This saves
+ *  memory and an indirection per access when the trailing dimensions
+ *  are small.  For instance, a 1000x1000x3 array of floats with one
+ *  level of pointers can be used as
+ *
+ *      float (*(*a))[3] = ndmalloc_depth(sizeof(float), 1, 3, 1000, 1000, 3);
+ *      a[i][j][k] = 0.0f;
+ *
+ *  A 'depth' of rank-1 or more gives a normal array, and a 'depth'
+ *  of less than 1 fails.  The functions 'sndmalloc_depth' and
+ *  'sndcalloc_depth' are the non-variadic variants.  The array keeps
+ *  its full rank and shape for 'ndrank', 'ndsize' and 'ndshape', its
+ *  depth is returned by 'nddepth', and it is freed with 'ndfree'.
+ *  'ndrealloc' keeps the depth.
+ */
+
+/* Fixed-rank versions of ndmalloc, ndcalloc and ndview */
+void* ndmalloc1 (size_t size, size_t n0);
+void* ndmalloc2 (size_t size, size_t n0, size_t n1);
+void* ndmalloc3 (size_t size, size_t n0, size_t n1, size_t n2);
+void* ndmalloc4 (size_t size, size_t n0, size_t n1, size_t n2, size_t n3);
+void* ndcalloc1 (size_t size, size_t n0);
+void* ndcalloc2 (size_t size, size_t n0, size_t n1);
+void* ndcalloc3 (size_t size, size_t n0, size_t n1, size_t n2);
+void* ndcalloc4 (size_t size, size_t n0, size_t n1, size_t n2, size_t n3);
+void* ndview2   (void* data, size_t size, size_t n0, size_t n1);
+void* ndview3   (void* data, size_t size, size_t n0, size_t n1, size_t n2);
+void* ndview4   (void* data, size_t size, size_t n0, size_t n1, size_t n2, size_t n3);
+/* Description:
+ *  The functions 'ndmallocR', 'ndcallocR' and 'ndviewR', with R the
+ *  rank, have the same functionality as 'ndmalloc', 'ndcalloc' and
+ *  'ndview' with a rank of R, but take the dimensions as fixed
+ *  arguments and avoid most of the overhead of allocating small
+ *  arrays: the shape, internal header, pointer-to-pointer structure
+ *  and (except for views) the data are always placed in a single
+ *  block of memory, as with the ND_SINGLE_BLOCK option of
+ *  'ndmallopt', so that creating the array takes a single 'malloc'.
+ *  The result is freed with 'ndfree' as usual.
+ */
+
 /* Functions to get information about the multi-dimensional arrays
  * allocated by ndmalloc, ndcalloc or ndrealloc.
  */
       int     ndisknown  (const void* ptr);
       int     ndisview   (const void* ptr);
       short   ndrank     (const void* ptr);
+      short   nddepth    (const void* ptr);
+      size_t  ndcapacity (const void* ptr);
       size_t  ndsize     (const void* ptr, short dim);
       size_t  ndfullsize (const void* ptr);
       void*   nddata     (      void* ptr);
 const void*   ndcdata    (const void* ptr);
 const size_t* ndshape    (const void* ptr);
+      size_t  ndalignment(const void* ptr);
+      size_t  ndpitch    (const void* ptr);
 /* Descriptions:
  *  The function 'ndisknown' checks if 'ptr' is a 'known multi-dimensional
  *  array', i.e., whether it was allocated using ndmalloc, ndcalloc, or
  *  ndrealloc.  The return value is 1 if 'ptr' was successfully created
  *  with ndmalloc, ndcalloc, ndrealloc, or ndview (or their non-variadic
  *  versions sndmalloc, sndcalloc, sndrealloc and sndview), and 0 if it was
- *  not.
+ *  not.  By default, this is determined with a global registry of
+ *  known pointers.  If the library was compiled with
+ *  NDMALLOC_NO_REGISTRY defined, there is no registry, and the check
+ *  uses only a canary stored in the hidden header, so that it does
+ *  not take a lock.  The canary covers the address of the array and
+ *  the rank, element size, flags, number of pointer levels and shape
+ *  pointer stored in the header, keyed with a secret that is seeded
+ *  at run time on first use.  In that mode, an arbitrary pointer could
+ *  in principle be mistaken for a known array, although this is very
+ *  unlikely, and 'ndisknown' reads the size of a hidden header of
+ *  memory just before 'ptr', but nothing else, so 'ptr' must have
+ *  that much readable memory before it.
+ *  In either mode, 'ndisknown' does not take a lock, and can be
+ *  called from many threads while other threads allocate and free
+ *  arrays.
  *
  *  The function 'ndisview' checks if 'ptr' is a known
  *  multi-dimensional array view created with 'ndview' or 'sndview'.
@@ -109,6 +520,18 @@ const size_t* ndshape    (const void* ptr);
  *  'ptr'. If 'ptr' is not a known multi-dimensional array, the result
  *  is undefined.
  *
+ *  The function 'nddepth' returns the number of levels of pointers
+ *  of multi-dimensional array 'ptr', which is rank-1 (or 0 for rank
+ *  1) unless it was allocated with 'ndmalloc_depth' or
+ *  'ndcalloc_depth'.  If 'ptr' is not a known multi-dimensional array,
+ *  the result is undefined.
+ *
+ *  The function 'ndcapacity' returns the number of rows of the first
+ *  dimension that fit in the memory of 'ptr', which is ndsize(ptr,0)
+ *  unless capacity was reserved with 'ndreserve' or 'ndappend'.  If
+ *  'ptr' is not a known multi-dimensional array, the result is
+ *  undefined.
+ *
  *  The function 'ndsize' returns the extent in the given dimension
  *  'dim'. If 'ptr' is not a known multi-dimensional array, the result
  *  is undefined.
@@ -116,16 +539,163 @@ const size_t* ndshape    (const void* ptr);
  *  The function 'ndfullsize' returns the total number of elements in
  *  the multi-dimensional arrays (the product of all ndsize's). If 'ptr'
  *  is not a known multi-dimensional array, the result is undefined.
+ *  For pitched arrays, the padding is not included in this number.
  *
  *  The function 'nddata' returns the start of the data. The result
  *  is undefined if 'ptr' is not a known multi-dimensional array.  The
  *  function 'ndcdata' does the same but a returns a const pointer, and
- *  can be used with a const pointer as an argument.
+ *  can be used with a const pointer as an argument.  For pitched
+ *  arrays, the data includes the padding after each row, see 'ndpitch'.
  *
  *  The function 'ndshape' returns a pointer the first element of an
  *  array of integers which give the shape of the multi-dimensional
  *  array. The result is undefined if 'ptr' is not a known
  *  multi-dimensional array.
+ *
+ *  The function 'ndalignment' returns the alignment of the data of
+ *  the array, i.e., the largest power of two that divides the address
+ *  returned by 'nddata'.  This can be larger than the alignment that
+ *  was requested.  The result is undefined if 'ptr' is not a known
+ *  multi-dimensional array.
+ *
+ *  The function 'ndpitch' returns the number of elements between the
+ *  starts of consecutive rows of the last dimension in the data. This
+ *  is ndsize(ptr,ndrank(ptr)-1) unless the array was allocated with
+ *  'ndmalloc_pitched' or 'ndcalloc_pitched'.  The result is undefined
+ *  if 'ptr' is not a known multi-dimensional array.
+ */
+
+/* Global options for the allocation of multi-dimensional arrays. */
+int ndmallopt (int param, size_t value);
+#define ND_SINGLE_BLOCK   1
+#define ND_MMAP_THRESHOLD 2
+#define ND_MMAP_FLAGS     3
+#define ND_CACHE_BYTES    4
+#define ND_DEFERRED_FREE  5
+/* Flags for ND_MMAP_FLAGS, to be or-ed together */
+#define ND_MMAP_HUGEPAGE  1
+#define ND_MMAP_POPULATE  2
+#define ND_MMAP_LOCK      4
+/* Description:
+ *  The function 'ndmallopt' sets the global option 'param' to
+ *  'value', in the same spirit as 'mallopt'.  It returns 1 on success
+ *  and 0 if 'param' is not a known option.  Options only affect arrays
+ *  allocated after they were set.  Options are not thread-safe and
+ *  are meant to be set at the start of a program.  Known options are:
+ *
+ *  ND_SINGLE_BLOCK: if 'value' is nonzero, 'ndmalloc', 'ndcalloc'
+ *   and 'ndrealloc' (and their non-variadic versions) place the
+ *   internal header, the shape, the pointer-to-pointer structure and
+ *   the data of a new array in a single contiguous block of memory,
+ *   so that creating or freeing the array takes a single call to
+ *   'malloc' or 'free'.  Reallocating such an array always allocates
+ *   a new block and copies the data; unlike for other arrays, the
+ *   original 'ptr' is left intact when this fails.  Default is 0.
+ *
+ *  ND_MMAP_THRESHOLD: if 'value' is nonzero, any memory block of at
+ *   least 'value' bytes that is needed for the data or the
+ *   pointer-to-pointer structure of an array is allocated with an
+ *   anonymous memory mapping ('mmap') instead of with 'malloc'.
+ *   Such memory is zeroed by the operating system when it is first
+ *   touched, so 'ndcalloc' costs nothing up front for large arrays.
+ *   Reallocating mapped data copies it.  Default is 0 (never map).
+ *
+ *  ND_MMAP_FLAGS: 'value' is a combination of the following flags,
+ *   which apply to mapped memory.  ND_MMAP_HUGEPAGE aligns mappings
+ *   of at least 2 MiB to 2 MiB and asks for transparent huge pages
+ *   ('madvise' with MADV_HUGEPAGE), which reduces TLB misses for
+ *   large arrays. ND_MMAP_POPULATE touches all pages at allocation
+ *   time, so that later accesses do not incur page faults. ND_MMAP_LOCK
+ *   locks the pages in memory ('mlock'); if this fails, e.g. because of
+ *   a resource limit, the allocation still succeeds.  Default is 0.
+ *
+ *  ND_CACHE_BYTES: if 'value' is nonzero, 'ndfree' does not release
+ *   arrays allocated by 'ndmalloc' or 'ndcalloc' (or their
+ *   non-variadic versions), but parks them, with their
+ *   pointer-to-pointer structure intact, in a cache of at most
+ *   'value' bytes (counting data and pointers). A subsequent
+ *   'ndmalloc' or 'ndcalloc' with the same element size, rank and
+ *   shape hands back a parked array instead of allocating a new one;
+ *   'ndcalloc' then zeroes its data.  When the cache is full, the
+ *   oldest parked arrays are freed. Parked arrays are not known
+ *   arrays. Setting a smaller value frees parked arrays as needed,
+ *   and 0 switches the cache off and frees them all.  Default is 0.
+ *   Unlike the other options, this one may be changed at any time.
+ *
+ *  ND_DEFERRED_FREE: if 'value' is nonzero, 'ndfree' behaves as
+ *   'ndfree_deferred'.  Default is 0.
+ *
+ *  ND_MMAP_THRESHOLD and ND_MMAP_FLAGS are only known options on
+ *  unix-like systems, and if the library was not compiled with
+ *  NDMALLOC_NO_MMAP defined. ND_DEFERRED_FREE is only known if
+ *  threads are available, i.e., on unix-like systems or if the
+ *  library was compiled with NDREG_PTHREAD_LOCK defined.
+ */
+
+/* User-supplied allocators for the memory of multi-dimensional arrays */
+typedef struct ndallocator {
+    void* (*malloc_fn)  (size_t size, void* ctx);
+    void* (*calloc_fn)  (size_t nmemb, size_t size, void* ctx);
+    void* (*realloc_fn) (void* ptr, size_t size, void* ctx);
+    void  (*free_fn)    (void* ptr, void* ctx);
+    void*   ctx;
+} ndallocator_t;
+int ndset_allocator        (int which, const ndallocator_t* allocator);
+int ndset_thread_allocator (int which, const ndallocator_t* allocator);
+/* Values for 'which', to be or-ed together */
+#define ND_ALLOC_DATA 1
+#define ND_ALLOC_META 2
+/* Description:
+ *  The function 'ndset_allocator' makes the library get the memory
+ *  for the data of arrays (if 'which' includes ND_ALLOC_DATA) and/or
+ *  for their metadata, i.e., their pointer-to-pointer structures and
+ *  shapes (if 'which' includes ND_ALLOC_META), from 'allocator'
+ *  instead of from 'malloc', 'calloc', 'realloc' and 'free'. Every
+ *  function of the allocator gets its 'ctx' member as last argument.
+ *  'malloc_fn' and 'free_fn' are required, and memory from
+ *  'malloc_fn' must be aligned as memory from 'malloc' is.  If
+ *  'calloc_fn' is NULL, 'malloc_fn' is used and the memory is zeroed
+ *  afterwards, and if 'realloc_fn' is NULL, 'ndrealloc' copies the
+ *  data.  Passing NULL for 'allocator' restores the standard
+ *  functions.  The function returns 1 on success and 0 if 'which' or
+ *  'allocator' is invalid.
+ *
+ *  Each array remembers the allocators it was allocated with, and
+ *  'ndfree' returns its memory to them, so 'allocator' must stay
+ *  valid as long as such arrays exist.  Arrays of rank 1 and arrays
+ *  allocated as single blocks (see ND_SINGLE_BLOCK and the fixed-rank
+ *  functions) are allocated entirely as data, and so are arenas.
+ *  Memory that is mapped (see ND_MMAP_THRESHOLD and
+ *  'ndcalloc_parallel') does not come from the allocators.  Arrays
+ *  parked in the cache (see ND_CACHE_BYTES) are only handed out again
+ *  if they came from the allocators in effect for the caller; the
+ *  others stay parked until they are pushed out or trimmed with
+ *  'ndcache_trim'.
+ *
+ *  The function 'ndset_thread_allocator' does the same for the
+ *  calling thread only, overriding what was set with
+ *  'ndset_allocator' until it is set to NULL again.  It returns 0 if
+ *  the compiler does not support thread-local storage.  Like
+ *  'ndmallopt', 'ndset_allocator' is not thread-safe.
+ */
+
+/* Functions to control the cache of freed arrays (see ND_CACHE_BYTES). */
+size_t ndcache_trim  (size_t bytes);
+void   ndcache_stats (size_t* hits, size_t* misses, size_t* bytes);
+/* Description:
+ *  The function 'ndcache_trim' frees the arrays parked in the cache,
+ *  oldest first, until at most 'bytes' bytes remain parked, and
+ *  returns the number of bytes that remain parked.  Call
+ *  'ndcache_trim(0)' to release all of them.
+ *
+ *  The function 'ndcache_stats' stores in '*hits' the number of
+ *  allocations that were served from the cache, in '*misses' the
+ *  number of allocations that were looked up in the cache but had no
+ *  match, and in '*bytes' the number of bytes currently parked. Any
+ *  of these pointers may be NULL.
+ *
+ *  The cache is thread-safe if the library was compiled with
+ *  NDREG_PTHREAD_LOCK defined.
  */
 
 
@@ -137,6 +707,29 @@ const size_t* ndshape    (const void* ptr);
 #define autoview6(a)  ndview(a,sizeof(******(a)),6,sizeof(a)/sizeof(*(a)),sizeof(*(a))/sizeof(**(a)),sizeof(**(a))/sizeof(***(a)),sizeof(***(a))/sizeof(****(a)),sizeof(****(a))/sizeof(*****(a))),sizeof(*****(a))/sizeof(******(a)))
 #define autoview7(a)  ndview(a,sizeof(*******(a)),7,sizeof(a)/sizeof(*(a)),sizeof(*(a))/sizeof(**(a)),sizeof(**(a))/sizeof(***(a)),sizeof(***(a))/sizeof(****(a)),sizeof(****(a))/sizeof(*****(a))),sizeof(*****(a))/sizeof(******(a))),sizeof(******(a))/sizeof(*******(a)))
 
+/* Macros to index the data of arrays through pointers to variable-length arrays */
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 199901L && !defined(__STDC_NO_VLA__) && !defined(__cplusplus)
+#define ndvla2(a,T)  ((T(*)[ndpitch(a)])nddata(a))
+#define ndvla3(a,T)  ((T(*)[ndsize(a,1)][ndpitch(a)])nddata(a))
+#define ndvla4(a,T)  ((T(*)[ndsize(a,1)][ndsize(a,2)][ndpitch(a)])nddata(a))
+#endif
+/* Description:
+ *  The macros 'ndvla2', 'ndvla3' and 'ndvla4' return the data of the
+ *  nd array 'a' of rank 2, 3 or 4 and element type 'T' as a pointer
+ *  to a variable-length array, whose dimensions are taken from the
+ *  shape and pitch of 'a'.  Indexing through this pointer needs no
+ *  loads of the pointer-to-pointer structure, so that the compiler
+ *  can use plain strided address arithmetic and vectorize loops, e.g.
+ *
+ *      float** a = ndmalloc(sizeof(float), 2, n0, n1);
+ *      float (*v)[ndpitch(a)] = ndvla2(a, float);
+ *      v[i][j] = 1.0f;          (same element as a[i][j])
+ *
+ *  The macros work for pitched arrays and arrays with fewer levels of
+ *  pointers as well, and are only available for C99 and later
+ *  compilers that support variable-length arrays.
+ */
+
 #ifdef __cplusplus
 }
 #endif
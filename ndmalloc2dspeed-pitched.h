@@ -0,0 +1,2 @@
+/* ndmalloc2dspeed-pitched.h */
+double case_pitched(int repeat);
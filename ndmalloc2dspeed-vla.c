@@ -0,0 +1,42 @@
+/* 
+ * ndmalloc2dspeed-vla.c - speed test for ndmalloc dynamic array
+ * library indexed through pointers to variable-length arrays
+ */
+
+#include <stdlib.h>
+#include "ndmalloc.h"
+#include "optbarrier.h"
+#include "ndef.h"
+
+double case_vla(int repeat)
+{
+    int i, j;
+    double d = 0.0;
+    float** pa = ndmalloc(sizeof(float), 2, n, n);
+    float** pb = ndmalloc(sizeof(float), 2, n, n);
+    float** pc = ndmalloc(sizeof(float), 2, n, n);
+    float (*a)[ndpitch(pa)] = ndvla2(pa, float);
+    float (*b)[ndpitch(pb)] = ndvla2(pb, float);
+    float (*c)[ndpitch(pc)] = ndvla2(pc, float);
+    while (repeat--) {
+        for (i=0;i<n;i++)
+            for (j=0;j<n;j++) {
+                a[i][j] = i+repeat;
+                b[i][j] = j+repeat/2;
+            }
+        optbarrier(&a[0][0],&b[0][0],&repeat);
+        for (i=0;i<n;i++)
+            for (j=0;j<n;j++) 
+                c[i][j] = a[i][j]+b[i][j];
+        optbarrier(&c[0][0],&c[0][0],&repeat);
+        for (i=0;i<n;i++)
+            for (j=0;j<n;j++) 
+                d += c[i][j];
+        optbarrier(&c[0][0],(float*)&d,&repeat);
+    }
+    ndfree(pa);
+    ndfree(pb);
+    ndfree(pc);
+    return d;
+}
+
@@ -0,0 +1,2 @@
+/* ndmalloc2dspeed-vla.h */
+double case_vla(int repeat);
@@ -13,6 +13,8 @@
 #include "ndmalloc2dspeed-ndmalloc.h"
 #include "ndmalloc2dspeed-dynamic.h"
 #include "ndmalloc2dspeed-auto.h"
+#include "ndmalloc2dspeed-pitched.h"
+#include "ndmalloc2dspeed-vla.h"
 
 int main(int argc, char**argv) 
 {
@@ -49,6 +51,16 @@ int main(int argc, char**argv)
         fflush(stdout);
         answer = STOPWATCH(case_dyn, repeat);
         break;
+    case 4: 
+        printf("pitched");
+        fflush(stdout);
+        answer = STOPWATCH(case_pitched, repeat);
+        break;
+    case 5: 
+        printf("vla");
+        fflush(stdout);
+        answer = STOPWATCH(case_vla, repeat);
+        break;
     }
 
     check = case_exact(1)+case_exact(repeat-1);
@@ -0,0 +1,885 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "ndmalloc.h"
+
+void fill(double** array)
+{
+    const size_t* shape = ndshape(array);
+    double* data = nddata(array);
+    size_t i;
+    assert( ndisknown(array) );
+    assert( ndrank(array) == 2 );
+    for (i = 0; i < shape[0]*shape[1]; i++)
+        data[i] = i+1;
+}
+
+/* counting allocator, with ctx pointing to the number of live blocks */
+void* count_malloc(size_t size, void* ctx)
+{
+    ++*(int*)ctx;
+    return malloc(size);
+}
+
+void* count_realloc(void* ptr, size_t size, void* ctx)
+{
+    (void)ctx;
+    return realloc(ptr, size);
+}
+
+void* fail_realloc(void* ptr, size_t size, void* ctx)
+{
+    (void)ptr; (void)size; (void)ctx;
+    return NULL;
+}
+
+void count_free(void* ptr, void* ctx)
+{
+    if (ptr != NULL)
+        --*(int*)ctx;
+    free(ptr);
+}
+
+void print(double** array)
+{
+    const size_t* shape = ndshape(array);
+    size_t i,j;
+    assert( ndisknown(array) );
+    for (i = 0; i < shape[0]; i++) {
+        for (j = 0; j < shape[1]; j++)
+            printf("%.1f\t",array[i][j]);
+        printf("\n");
+    }
+}
+
+int main()
+{
+    double** a;
+    double** b;
+    double** c;
+    double*** d;
+    double* e;
+    size_t i;
+
+    assert( ndmallopt(ND_SINGLE_BLOCK, 1) == 1 );
+    assert( ndmallopt(-1, 1) == 0 );
+
+    a = ndmalloc(sizeof(double), 2, 4, 3);
+    assert( (size_t)nddata(a) % (2*sizeof(void*)) == 0 );
+    fill(a);
+    print(a);
+
+    b = ndrealloc(a, sizeof(double), 2, 3, 5);
+    assert( ndisknown(b) );
+    assert( ndsize(b,0) == 3 && ndsize(b,1) == 5 );
+    b[2][2] = b[2][3] = b[2][4] = 0.0;
+    print(b);
+
+    c = ndview(nddata(b), sizeof(double), 2, 5, 2);
+    print(c);
+    ndfree(c);
+    ndfree(b);
+
+    d = ndcalloc(sizeof(double), 3, 2, 3, 4);
+    assert( ndfullsize(d) == 24 );
+    for (i = 0; i < 24; i++)
+        assert( ((double*)nddata(d))[i] == 0.0 );
+    d[1][2][3] = 1.0;
+    assert( ((double*)nddata(d))[23] == 1.0 );
+    ndfree(d);
+
+    e = ndmalloc(sizeof(double), 1, 7);
+    assert( ndisknown(e) && ndsize(e,0) == 7 );
+    e = ndrealloc(e, sizeof(double), 1, 70);
+    assert( ndisknown(e) && ndsize(e,0) == 70 );
+    ndfree(e);
+
+    ndmallopt(ND_SINGLE_BLOCK, 0);
+
+    /* aligned data, with and without single blocks */
+    for (i = 0; i < 2; i++) {
+        ndmallopt(ND_SINGLE_BLOCK, i);
+        assert( ndmalloc_aligned(sizeof(double), 48, 2, 3, 3) == NULL );
+        a = ndmalloc_aligned(sizeof(double), 64, 2, 3, 3);
+        assert( ndalignment(a) >= 64 );
+        fill(a);
+        b = ndrealloc(a, sizeof(double), 2, 5, 3);
+        assert( ndalignment(b) >= 64 );
+        assert( b[2][2] == 9.0 );
+        ndfree(b);
+        d = ndcalloc_aligned(sizeof(double), 4096, 3, 2, 3, 4);
+        assert( ndalignment(d) >= 4096 );
+        assert( d[1][2][3] == 0.0 );
+        ndfree(d);
+        e = ndmalloc_aligned(sizeof(double), 2097152, 1, 10);
+        assert( ndalignment(e) >= 2097152 );
+        ndfree(e);
+    }
+    ndmallopt(ND_SINGLE_BLOCK, 0);
+
+    /* padded rows, with and without single blocks */
+    for (i = 0; i < 2; i++) {
+        size_t j, k;
+        ndmallopt(ND_SINGLE_BLOCK, i);
+        assert( ndmalloc_pitched(sizeof(double), 2, 2, 3, 3) == NULL );
+        a = ndcalloc_pitched(sizeof(double), 0, 2, 4, 64);
+        assert( ndpitch(a) > 64 );
+        assert( (ndpitch(a)*sizeof(double)) % 64 == 0 );
+        assert( ndalignment(a) >= 64 );
+        assert( ndfullsize(a) == 4*64 );
+        assert( ndview(a, sizeof(double), 2, 64, 4) == NULL );
+        for (j = 0; j < 4; j++)
+            for (k = 0; k < 64; k++)
+                a[j][k] = j*64+k;
+        assert( ((double*)nddata(a))[2*ndpitch(a)+5] == 2*64+5 );
+        b = ndrealloc(a, sizeof(double), 2, 8, 32);
+        assert( ndpitch(b) >= 64 );
+        for (j = 0; j < 8; j++)
+            for (k = 0; k < 32; k++)
+                assert( b[j][k] == j*32+k );
+        ndfree(b);
+        a = ndmalloc_pitched(sizeof(double), 5, 2, 3, 3);
+        assert( ndpitch(a) == 5 && &a[1][0] == &a[0][5] );
+        ndfree(a);
+    }
+    ndmallopt(ND_SINGLE_BLOCK, 0);
+
+    /* mapped memory, with and without single blocks */
+    if (ndmallopt(ND_MMAP_THRESHOLD, 1)) {
+        assert( ndmallopt(ND_MMAP_FLAGS, ND_MMAP_HUGEPAGE|ND_MMAP_POPULATE) );
+        for (i = 0; i < 2; i++) {
+            ndmallopt(ND_SINGLE_BLOCK, i);
+            d = ndcalloc(sizeof(double), 3, 64, 64, 128);
+            assert( d[63][63][127] == 0.0 );
+            d[63][63][127] = 1.0;
+            ndfree(d);
+            a = ndmalloc(sizeof(double), 2, 4, 3);
+            fill(a);
+            b = ndrealloc(a, sizeof(double), 2, 2, 3);
+            assert( b[1][2] == 6.0 );
+            ndfree(b);
+            e = ndmalloc(sizeof(double), 1, 5);
+            e[4] = 5.0;
+            e = ndrealloc(e, sizeof(double), 1, 5000);
+            assert( e[4] == 5.0 );
+            ndfree(e);
+            a = ndmalloc_aligned(sizeof(double), 8192, 2, 3, 3);
+            assert( ndalignment(a) >= 8192 );
+            ndfree(a);
+        }
+        ndmallopt(ND_SINGLE_BLOCK, 0);
+        ndmallopt(ND_MMAP_THRESHOLD, 0);
+        ndmallopt(ND_MMAP_FLAGS, 0);
+    }
+
+    /* parallel first touch */
+    for (i = 0; i < 3; i++) {
+        size_t j, k, l;
+        d = ndcalloc_parallel(sizeof(double), 3, (int)i, 3, 7, 5, 300);
+        assert( ndisknown(d) && ndfullsize(d) == 7*5*300 );
+        for (j = 0; j < 7; j++)
+            for (k = 0; k < 5; k++)
+                for (l = 0; l < 300; l++) {
+                    assert( d[j][k][l] == 0.0 );
+                    assert( &d[j][k][l] == (double*)nddata(d) + (j*5+k)*300+l );
+                }
+        ndfree(d);
+    }
+    e = ndcalloc_parallel(sizeof(double), 0, ND_NUMA_FIRSTTOUCH, 1, 1000);
+    assert( e[999] == 0.0 );
+    ndfree(e);
+    assert( ndcalloc_parallel(sizeof(double), 2, 99, 2, 2, 2) == NULL );
+
+    /* arenas */
+    {
+        ndarena_t* arena = ndarena_create(1000);
+        double*** first = NULL;
+        assert( arena != NULL );
+        for (i = 0; i < 3; i++) {
+            size_t j;
+            a = ndarena_malloc(arena, sizeof(double), 2, 4, 3);
+            assert( a != NULL && ! ndisknown(a) );
+            assert( ndrank(a) == 2 && ndsize(a,0) == 4 && ndsize(a,1) == 3 );
+            assert( ndalignment(a) >= 2*sizeof(void*) );
+            for (j = 0; j < 4*3; j++)
+                ((double*)nddata(a))[j] = j+1;
+            assert( a[3][2] == 12.0 );
+            d = ndarena_calloc(arena, sizeof(double), 3, 10, 10, 10);
+            assert( d != NULL && d[9][9][9] == 0.0 );
+            /* the chunk added for 'd' is kept by ndarena_reset */
+            if (i == 0)
+                first = d;
+            assert( d == first );
+            assert( ((double*)nddata(d))[999] == 0.0 );
+            e = ndarena_malloc(arena, sizeof(double), 1, 4);
+            assert( ndsize(e,0) == 4 );
+            for (j = 0; j < 4*3; j++)
+                assert( ((double*)nddata(a))[j] == j+1 );
+            /* arena arrays are refused instead of freed */
+            ndfree(a);
+            ndfree(nddata(d));
+            ndfree_deferred(e);
+            assert( ndrealloc(a, sizeof(double), 2, 3, 4) == NULL );
+            assert( a[3][2] == 12.0 );
+            ndarena_reset(arena);
+        }
+        ndarena_destroy(arena);
+    }
+
+    /* recycling cache */
+    {
+        size_t hits, misses, bytes;
+        assert( ndmallopt(ND_CACHE_BYTES, 1000000) == 1 );
+        a = ndmalloc(sizeof(double), 2, 4, 3);
+        fill(a);
+        c = a;
+        ndfree(a);
+        assert( ! ndisknown(c) );
+        ndcache_stats(&hits, &misses, &bytes);
+        assert( hits == 0 && misses == 1 && bytes == 12*sizeof(double)+4*sizeof(double*) );
+        a = ndmalloc(sizeof(double), 2, 3, 4);
+        assert( a != c );
+        b = ndcalloc(sizeof(double), 2, 4, 3);
+        assert( b == c && ndisknown(b) && ndrank(b) == 2 );
+        assert( ndsize(b,0) == 4 && ndsize(b,1) == 3 && b[3][2] == 0.0 );
+        fill(b);
+        assert( b[3][2] == 12.0 && ((double*)nddata(b))[11] == 12.0 );
+        ndcache_stats(&hits, &misses, &bytes);
+        assert( hits == 1 && misses == 2 && bytes == 0 );
+        ndfree(a);
+        ndfree(b);
+        e = ndmalloc(sizeof(double), 1, 7);
+        ndfree(e);
+        assert( ndmalloc(sizeof(double), 1, 7) == e );
+        ndfree(e);
+        ndcache_stats(NULL, NULL, &bytes);
+        assert( bytes > 0 );
+        assert( ndcache_trim(0) == 0 );
+        assert( ndmallopt(ND_SINGLE_BLOCK, 1) == 1 );
+        a = ndmalloc(sizeof(double), 2, 4, 3);
+        c = a;
+        ndfree(a);
+        a = ndmalloc(sizeof(double), 2, 4, 3);
+        assert( a == c && ndisknown(a) );
+        ndfree(a);
+        assert( ndmallopt(ND_SINGLE_BLOCK, 0) == 1 );
+        assert( ndmallopt(ND_CACHE_BYTES, 0) == 1 );
+        ndcache_stats(NULL, NULL, &bytes);
+        assert( bytes == 0 );
+    }
+
+    /* fixed-rank functions */
+    a = ndmalloc2(sizeof(double), 4, 3);
+    assert( ndisknown(a) && ndrank(a) == 2 && ndsize(a,0) == 4 && ndsize(a,1) == 3 );
+    fill(a);
+    assert( a[3][2] == 12.0 && a[1][0] == 4.0 );
+    b = ndview2(a, sizeof(double), 3, 4);
+    assert( ndisknown(b) && ndisview(b) && b[2][3] == 12.0 && b[1][0] == 5.0 );
+    ndfree(b);
+    assert( ndview2(a, sizeof(double), 5, 3) == NULL );
+    b = ndview2(nddata(a), sizeof(double), 2, 6);
+    assert( b[1][5] == 12.0 );
+    ndfree(b);
+    d = ndview3(a, sizeof(double), 2, 3, 2);
+    assert( ndrank(d) == 3 && d[1][2][1] == 12.0 && d[1][0][0] == 7.0 );
+    ndfree(d);
+    assert( a[3][2] == 12.0 );
+    ndfree(a);
+    d = ndcalloc3(sizeof(double), 5, 6, 7);
+    assert( ndisknown(d) && ndsize(d,2) == 7 && d[4][5][6] == 0.0 );
+    for (i = 0; i < 5*6*7; i++)
+        ((double*)nddata(d))[i] = i;
+    assert( d[4][5][6] == 5*6*7-1 && d[1][2][3] == 42+14+3 );
+    ndfree(d);
+    e = ndcalloc1(sizeof(double), 9);
+    assert( ndrank(e) == 1 && ndsize(e,0) == 9 && e[8] == 0.0 );
+    ndfree(e);
+    {
+        double**** f = ndmalloc4(sizeof(double), 2, 3, 4, 5);
+        assert( ndrank(f) == 4 && ndfullsize(f) == 120 );
+        for (i = 0; i < 120; i++)
+            ((double*)nddata(f))[i] = i;
+        assert( f[1][2][3][4] == 119.0 && f[1][0][0][0] == 60.0 );
+        ndfree(f);
+        f = ndview4(nddata(d = ndcalloc3(sizeof(double), 2, 3, 20)), 
+                    sizeof(double), 2, 3, 4, 5);
+        assert( f[1][2][3][4] == 0.0 );
+        ndfree(f);
+        ndfree(d);
+    }
+
+    /* allocators */
+    {
+        int ndatablocks = 0, nmetablocks = 0;
+        ndallocator_t dataalloc = { count_malloc, NULL, count_realloc, count_free, NULL };
+        ndallocator_t metaalloc = { count_malloc, NULL, NULL, count_free, NULL };
+        dataalloc.ctx = &ndatablocks;
+        metaalloc.ctx = &nmetablocks;
+        assert( ndset_allocator(0, &dataalloc) == 0 );
+        assert( ndset_allocator(ND_ALLOC_DATA, &dataalloc) == 1 );
+        assert( ndset_allocator(ND_ALLOC_META, &metaalloc) == 1 );
+        a = ndcalloc(sizeof(double), 2, 4, 3);
+        assert( ndatablocks == 1 && nmetablocks == 2 && a[3][2] == 0.0 );
+        fill(a);
+        a = ndrealloc(a, sizeof(double), 2, 3, 5);
+        assert( a != NULL && a[2][1] == 12.0 && ndatablocks == 1 && nmetablocks == 2 );
+        e = ndmalloc(sizeof(double), 1, 10);
+        assert( ndatablocks == 3 && nmetablocks == 2 );
+        assert( ndset_allocator(ND_ALLOC_DATA|ND_ALLOC_META, NULL) == 1 );
+        b = ndmalloc(sizeof(double), 2, 4, 3);
+        assert( ndatablocks == 3 && nmetablocks == 2 );
+        ndfree(b);
+        ndfree(a);
+        ndfree(e);
+        assert( ndatablocks == 0 && nmetablocks == 0 );
+        /* the cache only hands out arrays of the allocators in effect */
+        assert( ndmallopt(ND_CACHE_BYTES, 1000000) == 1 );
+        c = ndmalloc(sizeof(double), 2, 4, 3);
+        ndfree(c);
+        assert( ndset_allocator(ND_ALLOC_DATA, &dataalloc) == 1 );
+        assert( ndset_allocator(ND_ALLOC_META, &metaalloc) == 1 );
+        b = ndmalloc(sizeof(double), 2, 4, 3);
+        assert( b != c && ndatablocks == 1 && nmetablocks == 2 );
+        ndfree(b);
+        assert( ndmalloc(sizeof(double), 2, 4, 3) == b );
+        assert( ndatablocks == 1 && nmetablocks == 2 );
+        assert( ndset_allocator(ND_ALLOC_DATA|ND_ALLOC_META, NULL) == 1 );
+        ndfree(b);
+        assert( ndmalloc(sizeof(double), 2, 4, 3) == c );
+        ndfree(c);
+        assert( ndmallopt(ND_CACHE_BYTES, 0) == 1 );
+        assert( ndatablocks == 0 && nmetablocks == 0 );
+        if (ndset_thread_allocator(ND_ALLOC_DATA, &dataalloc)) {
+            assert( ndmallopt(ND_SINGLE_BLOCK, 1) == 1 );
+            a = ndmalloc(sizeof(double), 2, 4, 3);
+            b = ndmalloc2(sizeof(double), 4, 3);
+            assert( ndatablocks == 2 && nmetablocks == 0 );
+            assert( ndset_thread_allocator(ND_ALLOC_DATA, NULL) == 1 );
+            ndfree(a);
+            ndfree(b);
+            assert( ndmallopt(ND_SINGLE_BLOCK, 0) == 1 );
+            assert( ndatablocks == 0 );
+        }
+        /* deferred frees */
+        assert( ndset_allocator(ND_ALLOC_DATA, &dataalloc) == 1 );
+        assert( ndset_allocator(ND_ALLOC_META, &metaalloc) == 1 );
+        {
+            double** arrays[300];
+            for (i = 0; i < 300; i++)
+                arrays[i] = ndmalloc(sizeof(double), 2, 4, 3);
+            e = ndmalloc(sizeof(double), 1, 10);
+            assert( ndatablocks == 302 && nmetablocks == 600 );
+            /* the allocator is not thread-safe, so do not allocate until
+               flushed */
+            for (i = 0; i < 300; i++)
+                ndfree_deferred(arrays[i]);
+            ndfree_deferred(e);
+            ndfree_flush();
+        }
+        assert( ndatablocks == 0 && nmetablocks == 0 );
+        if (ndmallopt(ND_DEFERRED_FREE, 1)) {
+            d = ndcalloc(sizeof(double), 3, 4, 5, 6);
+            ndfree(d);
+            ndfree_flush();
+            assert( ndatablocks == 0 && nmetablocks == 0 );
+            assert( ndmallopt(ND_DEFERRED_FREE, 0) == 1 );
+        }
+        /* reserving after switching allocators moves the shape too */
+        a = ndmalloc(sizeof(double), 2, 4, 3);
+        e = ndmalloc(sizeof(double), 1, 4);
+        a[3][2] = 12.0;
+        e[3] = 3.0;
+        assert( ndset_allocator(ND_ALLOC_DATA|ND_ALLOC_META, NULL) == 1 );
+        a = ndreserve(a, 10);
+        e = ndappend(e, 6);
+        assert( a != NULL && a[3][2] == 12.0 && e != NULL && e[3] == 3.0 );
+        assert( ndatablocks == 0 && nmetablocks == 0 );
+        assert( ndset_allocator(ND_ALLOC_DATA, &dataalloc) == 1 );
+        assert( ndset_allocator(ND_ALLOC_META, &metaalloc) == 1 );
+        a = ndappend(a, 7);
+        e = ndreserve(e, 20);
+        assert( a != NULL && a[3][2] == 12.0 && e != NULL && e[3] == 3.0 );
+        assert( ndatablocks == 3 && nmetablocks == 2 );
+        ndfree(a);
+        ndfree(e);
+        assert( ndatablocks == 0 && nmetablocks == 0 );
+        assert( ndset_allocator(ND_ALLOC_DATA|ND_ALLOC_META, NULL) == 1 );
+        /* more blocks than the queue holds: the caller waits for room */
+        {
+            double** arrays[600];
+            for (i = 0; i < 600; i++)
+                arrays[i] = ndmalloc(sizeof(double), 2, 40, 30);
+            for (i = 0; i < 600; i++)
+                ndfree_deferred(arrays[i]);
+            ndfree_flush();
+        }
+    }
+
+    /* batches */
+    {
+        double** arrays[3];
+        double*** cubes[4];
+        double* vectors[2];
+        assert( ndcalloc_batch(sizeof(double), 3, (void**)arrays, 2, 4, 3) == 1 );
+        for (i = 0; i < 3; i++) {
+            assert( ndisknown(arrays[i]) && ndrank(arrays[i]) == 2 );
+            assert( ndsize(arrays[i],0) == 4 && ndsize(arrays[i],1) == 3 );
+            assert( arrays[i][3][2] == 0.0 );
+        }
+        fill(arrays[1]);
+        assert( arrays[1][3][2] == 12.0 && arrays[1][1][0] == 4.0 );
+        assert( arrays[0][3][2] == 0.0 && arrays[2][0][0] == 0.0 );
+        ndfree(arrays[1]);
+        assert( ndisknown(arrays[0]) && ndisknown(arrays[2]) );
+        arrays[1] = arrays[2];
+        ndfree_batch((void**)arrays, 2);
+        assert( ndmalloc_batch(sizeof(double), 4, (void**)cubes, 3, 2, 3, 4) == 1 );
+        for (i = 0; i < 4; i++) {
+            size_t j;
+            for (j = 0; j < 24; j++)
+                ((double*)nddata(cubes[i]))[j] = 100*i + j;
+        }
+        for (i = 0; i < 4; i++)
+            assert( cubes[i][1][2][3] == 100*i + 23 && cubes[i][1][0][1] == 100*i + 13 );
+        ndfree_batch((void**)cubes, 4);
+        assert( ndmalloc_batch(sizeof(double), 2, (void**)vectors, 1, 5) == 1 );
+        assert( ndsize(vectors[1],0) == 5 && vectors[1] - vectors[0] >= 5 );
+        ndfree_batch((void**)vectors, 2);
+    }
+
+    /* partial pointer tables */
+    {
+        double (**p)[4];
+        size_t j;
+        p = ndcalloc_depth(sizeof(double), 1, 3, 5, 6, 4);
+        assert( p != NULL && ndisknown(p) && ndrank(p) == 3 && nddepth(p) == 1 );
+        assert( ndsize(p,0) == 5 && ndsize(p,1) == 6 && ndsize(p,2) == 4 );
+        assert( ndfullsize(p) == 120 && ndpitch(p) == 4 );
+        assert( p[4][5][3] == 0.0 );
+        for (j = 0; j < 120; j++)
+            ((double*)nddata(p))[j] = j;
+        assert( p[1][2][3] == 35.0 && p[4][5][3] == 119.0 );
+        assert( (double*)p[1] == (double*)nddata(p) + 24 );
+        p = ndrealloc(p, sizeof(double), 3, 6, 6, 4);
+        assert( p != NULL && nddepth(p) == 1 && ndsize(p,0) == 6 );
+        assert( p[1][2][3] == 35.0 && p[4][5][3] == 119.0 );
+        ndfree(p);
+        d = ndmalloc_depth(sizeof(double), 2, 3, 2, 3, 4);
+        assert( d != NULL && nddepth(d) == 2 );
+        ndfree(d);
+        assert( ndmalloc_depth(sizeof(double), 0, 3, 2, 3, 4) == NULL );
+        a = ndmalloc_depth(sizeof(double), 1, 2, 2, 3);
+        assert( a != NULL && nddepth(a) == 1 );
+        ndfree(a);
+        {
+            /* more levels than fit in the small shape buffers */
+            size_t n12[12] = {2, 1, 1, 1, 1, 1, 1, 1, 1, 2, 1, 3};
+            void** v = sndmalloc_depth(sizeof(double), 9, 12, n12);
+            void** w;
+            assert( v != NULL && nddepth(v) == 9 && ndfullsize(v) == 12 );
+            w = v;
+            for (i = 0; i < 9; i++)
+                w = (void**)w[i == 0];
+            assert( (double*)w == (double*)nddata(v) + 6 );
+            ndfree(v);
+        }
+    }
+
+    /* reallocation fast paths */
+    {
+        int nblocks = 0;
+        ndallocator_t failalloc = { count_malloc, NULL, fail_realloc, count_free, NULL };
+        double* p;
+        a = ndmalloc(sizeof(double), 2, 4, 3);
+        fill(a);
+        p = nddata(a);
+        d = ndrealloc(a, sizeof(double), 3, 2, 3, 2);
+        assert( d != NULL && nddata(d) == p && d[1][2][1] == 12.0 );
+        a = ndrealloc(d, sizeof(double), 2, 2, 6);
+        assert( a != NULL && nddata(a) == p && a[1][5] == 12.0 );
+        e = ndrealloc(a, sizeof(double), 1, 12);
+        assert( e == p && ndrank(e) == 1 && e[11] == 12.0 );
+        a = ndrealloc(e, sizeof(double), 2, 3, 4);
+        assert( a != NULL && nddata(a) == p && a[2][3] == 12.0 );
+        a = ndrealloc(a, sizeof(double), 2, 3, 8);
+        assert( a != NULL && a[1][0] == 9.0 && a[1][3] == 12.0 );
+        ndfree(a);
+        assert( ndset_allocator(ND_ALLOC_DATA, &failalloc) == 1 );
+        failalloc.ctx = &nblocks;
+        a = ndmalloc(sizeof(double), 2, 4, 3);
+        fill(a);
+        assert( ndrealloc(a, sizeof(double), 2, 40, 3) == NULL );
+        assert( ndrealloc(a, sizeof(double), 3, 2, 5, 3) == NULL );
+        assert( ndisknown(a) && ndsize(a,0) == 4 && a[3][2] == 12.0 );
+        ndfree(a);
+        assert( nblocks == 0 );
+        assert( ndset_allocator(ND_ALLOC_DATA, NULL) == 1 );
+        if (ndmallopt(ND_MMAP_THRESHOLD, 1)) {
+            a = ndmalloc(sizeof(double), 2, 3, 4096);
+            a[2][4095] = 1.0;
+            a = ndrealloc(a, sizeof(double), 2, 300, 4096);
+            assert( a != NULL && a[2][4095] == 1.0 );
+            a[299][4095] = 2.0;
+            a = ndrealloc(a, sizeof(double), 2, 3, 4096);
+            assert( a != NULL && a[2][4095] == 1.0 );
+            ndfree(a);
+            ndmallopt(ND_MMAP_THRESHOLD, 0);
+        }
+    }
+
+    /* resizing that keeps multi-indices */
+    {
+        size_t i, j, k;
+        size_t n[3];
+        for (k = 0; k < 3; k++) {
+            if (k == 1)
+                ndmallopt(ND_SINGLE_BLOCK, 1);
+            if (k == 2)
+                ndmallopt(ND_MMAP_THRESHOLD, 1);
+            a = ndmalloc(sizeof(double), 2, 4, 3);
+            fill(a);
+            a = ndresize(a, 2, 6, 5);
+            assert( a != NULL && ndsize(a,0) == 6 && ndsize(a,1) == 5 );
+            for (i = 0; i < 6; i++)
+                for (j = 0; j < 5; j++)
+                    assert( a[i][j] == ((i < 4 && j < 3) ? 3*i+j+1 : 0.0) );
+            a = ndresize(a, 2, 3, 2);
+            assert( a != NULL && a[2][1] == 8.0 && a[1][0] == 4.0 );
+            a = ndresize(a, 2, 5, 1);
+            assert( a != NULL && a[2][0] == 7.0 && a[4][0] == 0.0 );
+            assert( ndresize(a, 3, 5, 1, 1) == NULL && ndisknown(a) );
+            ndfree(a);
+            ndmallopt(ND_SINGLE_BLOCK, 0);
+            ndmallopt(ND_MMAP_THRESHOLD, 0);
+        }
+        d = ndmalloc(sizeof(double), 3, 2, 3, 4);
+        for (i = 0; i < 24; i++)
+            ((double*)nddata(d))[i] = i;
+        n[0] = 3; n[1] = 4; n[2] = 5;
+        d = sndresize(d, 3, n);
+        assert( d != NULL && d[1][2][3] == 23.0 && d[0][1][2] == 6.0 );
+        assert( d[2][0][0] == 0.0 && d[1][3][4] == 0.0 && d[0][0][4] == 0.0 );
+        d = ndresize(d, 3, 2, 2, 2);
+        assert( d != NULL && d[1][1][1] == 17.0 && d[0][1][0] == 4.0 );
+        ndfree(d);
+        /* only the first dimension changes: the rows stay in place */
+        d = ndmalloc(sizeof(double), 3, 2, 3, 4);
+        for (i = 0; i < 24; i++)
+            ((double*)nddata(d))[i] = i;
+        d = ndresize(d, 3, 4, 3, 4);
+        assert( d != NULL && d[1][2][3] == 23.0 && d[0][1][2] == 6.0 );
+        assert( d[2][0][0] == 0.0 && d[3][2][3] == 0.0 );
+        d = ndresize(d, 3, 1, 3, 4);
+        assert( d != NULL && d[0][2][3] == 11.0 && ndsize(d,0) == 1 );
+        ndfree(d);
+        a = ndmalloc(sizeof(double), 2, 2500, 1100);
+        for (i = 0; i < 2500; i++)
+            for (j = 0; j < 1100; j++)
+                a[i][j] = i*10000.0 + j;
+        a = ndresize(a, 2, 2600, 1000);
+        assert( a != NULL && a[2499][999] == 24990999.0 && a[2500][0] == 0.0 );
+        a = ndresize(a, 2, 2700, 1200);
+        assert( a != NULL );
+        for (i = 0; i < 2700; i += 7)
+            for (j = 0; j < 1200; j += 3)
+                assert( a[i][j] == ((i < 2500 && j < 1000) ? i*10000.0 + j : 0.0) );
+        a = ndresize(a, 2, 1900, 1000);
+        assert( a != NULL );
+        for (i = 0; i < 1900; i += 7)
+            for (j = 0; j < 1000; j += 3)
+                assert( a[i][j] == i*10000.0 + j );
+        ndfree(a);
+    }
+
+    /* appending rows */
+    {
+        size_t i, j;
+        a = ndmalloc(sizeof(double), 2, 1, 3);
+        assert( ndcapacity(a) == 1 );
+        for (i = 0; i < 100; i++) {
+            if (i > 0)
+                a = ndappend(a, 1);
+            assert( a != NULL && ndsize(a,0) == i+1 && ndcapacity(a) >= i+1 );
+            for (j = 0; j < 3; j++)
+                a[i][j] = 3*i + j;
+        }
+        assert( ndfullsize(a) == 300 && ndisknown(nddata(a)) );
+        for (i = 0; i < 300; i++)
+            assert( ((double*)nddata(a))[i] == i && a[i/3][i%3] == i );
+        a = ndrealloc(a, sizeof(double), 2, 50, 3);
+        assert( a != NULL && ndcapacity(a) == 50 && a[49][2] == 149.0 );
+        ndfree(a);
+        d = ndmalloc(sizeof(double), 3, 2, 3, 4);
+        d[1][2][3] = 5.0;
+        d = ndreserve(d, 10);
+        assert( d != NULL && ndcapacity(d) == 10 && ndsize(d,0) == 2 );
+        assert( d[1][2][3] == 5.0 );
+        d = ndappend(d, 8);
+        assert( d != NULL && ndcapacity(d) == 10 && ndfullsize(d) == 120 );
+        d[9][2][3] = 7.0;
+        assert( ((double*)nddata(d))[119] == 7.0 );
+        d = ndappend(d, 1);
+        assert( d != NULL && ndcapacity(d) == 20 && d[1][2][3] == 5.0 && d[9][2][3] == 7.0 );
+        ndfree(d);
+        e = ndmalloc(sizeof(double), 1, 2);
+        e = ndappend(e, 3);
+        assert( e != NULL && ndsize(e,0) == 5 && ndcapacity(e) == 5 );
+        e[4] = 1.0;
+        ndfree(e);
+        a = ndmalloc_pitched(sizeof(double), 0, 2, 4, 3);
+        assert( ndappend(a, 1) == NULL && ndisknown(a) );
+        ndfree(a);
+    }
+
+    /* slices */
+    {
+        size_t start[3] = {1, 0, 1}, stop[3] = {4, 3, 3}, step[3] = {2, 2, 1};
+        size_t start2[2] = {1, 1}, stop2[2] = {3, 3};
+        double*** s;
+        double** t;
+        size_t i;
+        a = ndmalloc(sizeof(double), 2, 4, 3);
+        fill(a);
+        t = ndslice(a, start2, stop2, NULL);
+        assert( t != NULL && ndisview(t) && ndrank(t) == 2 );
+        assert( ndsize(t,0) == 2 && ndsize(t,1) == 2 && ndfullsize(t) == 4 );
+        assert( t[0][0] == a[1][1] && t[1][1] == a[2][2] && &t[1][0] == &a[2][1] );
+        assert( nddata(t) == &a[1][1] && ndview(t, sizeof(double), 2, 2, 2) == NULL );
+        t[0][1] = -1.0;
+        assert( a[1][2] == -1.0 );
+        ndfree(t);
+        assert( ndisknown(a) && a[3][2] == 12.0 );
+        assert( ndslice(a, start2, start, NULL) == NULL );
+        ndfree(a);
+        for (i = 0; i < 2; i++) {
+            d = i ? ndmalloc_depth(sizeof(double), 1, 3, 5, 4, 3)
+                  : ndmalloc_pitched(sizeof(double), 0, 3, 5, 4, 3);
+            if (i) {
+                ((double(*)[3])((void**)d)[3])[2][2] = 7.0;
+                ((double(*)[3])((void**)d)[1])[0][1] = 8.0;
+            } else {
+                d[3][2][2] = 7.0;
+                d[1][0][1] = 8.0;
+            }
+            s = ndslice(d, start, stop, step);
+            assert( s != NULL && ndsize(s,0) == 2 && ndsize(s,1) == 2 && ndsize(s,2) == 2 );
+            assert( s[1][1][1] == 7.0 && s[0][0][0] == 8.0 );
+            assert( &s[1][0][1] == (i ? &((double(*)[3])((void**)d)[3])[0][2] : &d[3][0][2]) );
+            step[2] = 2;
+            assert( ndslice(d, start, stop, step) == NULL );
+            step[2] = 1;
+            ndfree(s);
+            ndfree(d);
+        }
+        d = ndmalloc(sizeof(double), 3, 5, 4, 3);
+        d[3][2][2] = 7.0;
+        s = ndslice(d, start, stop, step);
+        {
+            size_t start3[3] = {1, 1, 1}, stop3[3] = {2, 2, 2};
+            double*** u = ndslice(s, start3, stop3, NULL);
+            assert( u != NULL && ndfullsize(u) == 1 && &u[0][0][0] == &d[3][2][2] );
+            ndfree(u);
+        }
+        ndfree(s);
+        ndfree(d);
+    }
+
+    /* broadcasting */
+    {
+        size_t i, j;
+        double*** s;
+        size_t n[3] = {2, 4, 3};
+        e = ndmalloc(sizeof(double), 1, 3);
+        for (j = 0; j < 3; j++)
+            e[j] = j + 0.5;
+        a = ndbroadcast(e, 2, 1000, 3);
+        assert( a != NULL && ndisview(a) && ndsize(a,0) == 1000 && ndsize(a,1) == 3 );
+        for (i = 0; i < 1000; i += 37)
+            for (j = 0; j < 3; j++)
+                assert( &a[i][j] == &e[j] );
+        ndfree(a);
+        assert( ndbroadcast(e, 2, 10, 4) == NULL );
+        b = ndmalloc(sizeof(double), 2, 4, 1);
+        assert( ndbroadcast(b, 2, 4, 3) == NULL );
+        ndfree(b);
+        b = ndmalloc(sizeof(double), 2, 1, 3);
+        b[0][2] = 9.0;
+        s = sndbroadcast(b, 3, n);
+        assert( s != NULL && ndfullsize(s) == 24 && s[1][3][2] == 9.0 && &s[0][2][1] == &b[0][1] );
+        a = ndbroadcast(b, 2, 4, 3);
+        assert( a != NULL && a[3][2] == 9.0 );
+        ndfree(a);
+        ndfree(s);
+        ndfree(b);
+        ndfree(e);
+    }
+
+    /* rotating and swapping rows */
+    {
+        size_t i, j, k;
+        double* first;
+        double*** f;
+        a = ndmalloc(sizeof(double), 2, 5, 3);
+        fill(a);
+        first = nddata(a);
+        assert( ndrotate(a, 2) && a[0][1] == 8.0 && a[4][0] == 4.0 );
+        assert( ndrotate(a, -3) && a[0][1] == 14.0 && a[1][2] == 3.0 );
+        assert( nddata(a) == first );
+        assert( ndrotate(a, 11) && a[0][0] == 1.0 );
+        assert( ndrotate(a, 1) );
+        a = ndresize(a, 2, 6, 3);
+        assert( a != NULL && a[0][1] == 5.0 && a[3][2] == 15.0 && a[4][0] == 1.0 );
+        ndfree(a);
+
+        a = ndmalloc(sizeof(double), 2, 4, 3);
+        b = ndmalloc(sizeof(double), 2, 4, 3);
+        fill(a);
+        for (i = 0; i < 4; i++)
+            for (j = 0; j < 3; j++)
+                b[i][j] = -a[i][j];
+        assert( ndrotate(b, 1) );
+        assert( ndswapdata(a, b) );
+        assert( a[0][1] == -5.0 && b[0][1] == 2.0 );
+        assert( ndswapdata(a, b) && a[3][2] == 12.0 && b[3][2] == -3.0 );
+        c = ndmalloc(sizeof(double), 2, 3, 4);
+        assert( ! ndswapdata(a, c) );
+        ndfree(c);
+        ndfree(a);
+        b = ndreserve(b, 10);
+        assert( b != NULL && b[0][1] == -5.0 && b[3][0] == -1.0 );
+        ndfree(b);
+
+        d = ndmalloc(sizeof(double), 3, 3, 2, 2);
+        f = ndmalloc(sizeof(double), 3, 3, 2, 2);
+        for (i = 0; i < 3; i++)
+            for (j = 0; j < 2; j++)
+                for (k = 0; k < 2; k++) {
+                    d[i][j][k] = i;
+                    f[i][j][k] = -(double)i;
+                }
+        assert( ndrotate(d, 1) && ndswapdata(d, f) );
+        assert( d[1][1][1] == -1.0 && f[0][1][0] == 1.0 && f[2][0][0] == 0.0 );
+        assert( ndswapdata(d, f) && d[2][0][0] == 0.0 && f[1][0][1] == -1.0 );
+        ndfree(f);
+        ndfree(d);
+    }
+
+    /* permuting rows */
+    {
+        size_t i, j;
+        size_t perm[4] = {2, 0, 3, 1};
+        size_t bad[4]  = {2, 0, 2, 1};
+        size_t perm3[3] = {1, 2, 0};
+        double* first;
+        a = ndmalloc(sizeof(double), 2, 4, 3);
+        fill(a);
+        first = nddata(a);
+        assert( ! ndpermute_rows(a, bad) && a[0][0] == 1.0 );
+        assert( ndpermute_rows(a, perm) && a[0][0] == 7.0 && a[3][2] == 6.0 );
+        assert( nddata(a) == first && first[0] == 1.0 );
+        b = ndview(a, sizeof(double), 2, 4, 3);
+        assert( ndrotate(b, 1) && b[0][0] == 4.0 && a[0][0] == 7.0 );
+        assert( ! ndcompact(b) );
+        ndfree(b);
+        assert( ndrotate(a, 1) && a[0][0] == 1.0 );
+        assert( ndcompact(a) && nddata(a) == first );
+        for (i = 0; i < 4; i++)
+            for (j = 0; j < 3; j++)
+                assert( first[3*i+j] == a[i][j] );
+        assert( a[0][0] == 1.0 && a[1][0] == 10.0 && a[2][0] == 4.0 );
+        ndfree(a);
+
+        d = ndmalloc(sizeof(double), 3, 3, 2, 2);
+        for (i = 0; i < 12; i++)
+            ((double*)nddata(d))[i] = i;
+        assert( ndpermute_rows(d, perm3) && d[0][1][1] == 7.0 );
+        assert( ndcompact(d) && ((double*)nddata(d))[0] == 4.0 && d[2][0][0] == 0.0 );
+        ndfree(d);
+    }
+
+    /* periodic views */
+    {
+        size_t i, j;
+        double sum;
+        double** u;
+        double*** q;
+        a = ndmalloc(sizeof(double), 2, 4, 3);
+        fill(a);
+        b = ndperiodic(a, 1);
+        assert( b != NULL && ndsize(b,0) == 6 && ndsize(b,1) == 3 );
+        assert( b[0] == a[3] && b[1] == a[0] && b[5] == a[0] );
+        u = b + 1;
+        sum = 0.0;
+        for (i = 0; i < 4; i++)
+            for (j = 0; j < 3; j++)
+                sum += u[i+1][j] - u[i-1][j];
+        assert( sum == 0.0 && u[-1][2] == 12.0 && u[4][0] == 1.0 );
+        ndfree(b);
+        b = ndperiodic(a, 5);
+        assert( b != NULL && b[0] == a[3] && b[13] == a[0] );
+        ndfree(b);
+        ndfree(a);
+
+        d = ndmalloc(sizeof(double), 3, 3, 2, 2);
+        q = ndperiodic(d, 1);
+        assert( q != NULL && ndsize(q,0) == 5 && ndsize(q,1) == 4 && ndsize(q,2) == 2 );
+        assert( q[0][-1] == d[2][1] && q[4][2] == d[0][0] && q[2][1] == d[1][1] );
+        {
+            double*** r = q + 1;
+            d[1][1][1] = 5.0;
+            assert( r[-1][0] == d[2][0] && r[-1][-1] == d[2][1] );
+            assert( r[3][2] == d[0][0] && r[3][-1] == d[0][1] && r[1][-1][1] == 5.0 );
+        }
+        {
+            /* slices of the view count from the start of its halo */
+            size_t start[3] = {0, 0, 0}, stop[3] = {2, 2, 2};
+            double*** s = ndslice(q, start, stop, NULL);
+            assert( s != NULL && s[0][0] == d[2][1] && s[1][1] == d[0][0] );
+            ndfree(s);
+        }
+        ndfree(q);
+        ndfree(d);
+        e = ndmalloc(sizeof(double), 1, 5);
+        assert( ndperiodic(e, 1) == NULL );
+        ndfree(e);
+    }
+
+    /* no contiguous views on views that are not contiguous */
+    {
+        size_t start[2] = {1, 0}, stop[2] = {3, 3};
+        a = ndmalloc(sizeof(double), 2, 4, 3);
+        b = ndslice(a, start, stop, NULL);
+        assert( b != NULL && ndview2(b, sizeof(double), 2, 3) == NULL );
+        assert( ndview(b, sizeof(double), 2, 2, 3) == NULL );
+        ndfree(b);
+        e = ndmalloc(sizeof(double), 1, 3);
+        b = ndbroadcast(e, 2, 4, 3);
+        assert( b != NULL && ndview2(b, sizeof(double), 1, 3) == NULL );
+        ndfree(b);
+        ndfree(e);
+        b = ndperiodic(a, 1);
+        assert( b != NULL && ndview2(b, sizeof(double), 4, 3) == NULL );
+        ndfree(b);
+        ndfree(a);
+    }
+
+#ifdef ndvla2
+    /* pointers to variable-length arrays */
+    {
+        a = ndmalloc_pitched(sizeof(double), 0, 2, 4, 3);
+        d = ndmalloc(sizeof(double), 3, 2, 3, 4);
+        {
+            double (*v)[ndpitch(a)] = ndvla2(a, double);
+            double (*w)[ndsize(d,1)][ndpitch(d)] = ndvla3(d, double);
+            fill(a);
+            assert( v[3][2] == a[3][2] && &v[1][0] == &a[1][0] );
+            w[1][2][3] = 7.0;
+            assert( d[1][2][3] == 7.0 && &w[0][1][0] == &d[0][1][0] );
+        }
+        ndfree(a);
+        ndfree(d);
+    }
+#endif
+
+    return 0;
+}